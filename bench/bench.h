@@ -0,0 +1,60 @@
+/*
+ * Software License Agreement (BSD License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <d@d-l.io>
+ */
+
+/*
+ * Helpers shared by the benchmark binaries.
+ *
+ * Results are printed as csv, one line per case:
+ *   name,variant,size,iters,ns_per_op,mb_per_s
+ */
+
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#define BENCH_MIN_NS    200000000ULL // run each case for at least 200 ms
+
+static volatile uint64_t bench_sink; // keep results alive
+
+
+static inline uint64_t bench_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void bench_header(void)
+{
+    printf("name,variant,size,iters,ns_per_op,mb_per_s\n");
+}
+
+static inline void bench_report(const char *name, const char *variant,
+        int size, uint64_t iters, uint64_t ns)
+{
+    double ns_op = (double)ns / iters;
+    printf("%s,%s,%d,%llu,%.2f,%.1f\n", name, variant, size,
+            (unsigned long long)iters, ns_op, size ? size * 1e3 / ns_op : 0);
+    fflush(stdout);
+}
+
+// run `body` in batches until BENCH_MIN_NS passed, then report
+#define BENCH_RUN(name, variant, size, body) do {                       \
+        uint64_t __iters = 0, __t0 = bench_ns(), __t;                   \
+        do {                                                            \
+            for (int __i = 0; __i < 1000; __i++) { body; }              \
+            __iters += 1000;                                            \
+        } while ((__t = bench_ns() - __t0) < BENCH_MIN_NS);             \
+        bench_report(name, variant, size, __iters, __t);                \
+    } while (0)
+
+#endif
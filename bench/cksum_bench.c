@@ -0,0 +1,69 @@
+/*
+ * Software License Agreement (BSD License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <d@d-l.io>
+ */
+
+/*
+ * Check every checksum implementation against the scalar one over random
+ * lengths and alignments, then time them over a sweep of payload sizes.
+ *
+ * Exit with error if any result differs.
+ */
+
+#include <stdlib.h>
+#include "ip_checksum.h"
+#include "bench.h"
+
+#define BUF_SIZE    (9000 + 64)
+#define CHECK_CNT   200000
+
+static uint8_t buf[BUF_SIZE];
+static const int sizes[] = { 8, 16, 48, 64, 128, 253, 256, 512, 1024, 1500, 4096, 9000 };
+
+
+int main(void)
+{
+    const struct ip_checksum_impl *impls;
+    int num = ip_checksum_get_impls(&impls);
+    int errors = 0;
+
+    srand(1);
+    for (int i = 0; i < BUF_SIZE; i++)
+        buf[i] = rand();
+
+    fprintf(stderr, "cksum: %d impls, in use: %s\n", num, ip_checksum_impl->name);
+
+    for (int n = 1; n < num; n++) {
+        for (int i = 0; i < CHECK_CNT; i++) {
+            int align = rand() % 64;
+            int len = rand() % (BUF_SIZE - 64);
+            u64 init = (u64)rand() << 16;
+            u64 ref = impls[0].partial(buf + align, len, init);
+            u64 val = impls[n].partial(buf + align, len, init);
+            if (val != ref) {
+                fprintf(stderr, "cksum: %s mismatch, align %d, len %d: %llx != %llx\n",
+                        impls[n].name, align, len, val, ref);
+                if (++errors > 10)
+                    return 1;
+            }
+        }
+        fprintf(stderr, "cksum: %s check %s\n", impls[n].name, errors ? "failed" : "ok");
+    }
+    if (errors)
+        return 1;
+
+    bench_header();
+    for (int n = 0; n < num; n++) {
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            u64 (*partial)(const void *, size_t, u64) = impls[n].partial;
+            int size = sizes[s];
+            BENCH_RUN("cksum_partial", impls[n].name, size,
+                    bench_sink += partial(buf + 1, size, bench_sink));
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,184 @@
+/*
+ * Software License Agreement (BSD License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <d@d-l.io>
+ */
+
+/*
+ * Time the per-packet conversion and framing functions in tight loops,
+ * for each address class and over payload sizes up to the frame limit:
+ *
+ *   ip2cdnet, cdn_frame_w, cdn_frame_r, cdnet2ip: per address class
+ *   tcp_udp_v6_checksum, cduart_fill_crc, cduart_rx_handle: variant "-"
+ *
+ * The size column is the udp payload, or the frame length for the uart
+ * ones. Exit with error if a conversion fails for a size it should accept.
+ */
+
+#include "main.h"
+#include "ip.h"
+#include "ip_checksum.h"
+#include "bench.h"
+
+frame_pool_t frame_pool; // for trace.c, the pool itself is not used here
+
+typedef struct {
+    const char  *name;
+    uint8_t     addr[3];    // cdnet address of the remote, the last 3 bytes of its ipv6
+} addr_class_t;
+
+static const addr_class_t classes[] = {
+    { "l0",         { 0x00, 0x00, 0xfe } },
+    { "l1_local",   { 0x80, 0x00, 0xfe } },
+    { "l1_ula",     { 0xa0, 0x05, 0xfe } }, // other net, through the router
+    { "mcast",      { 0xf0, 0x00, 0xfe } },
+};
+
+static const int sizes[] = { 1, 8, 16, 32, 64, 128, 200, 0 }; // 0: the class max
+static const int lens[] = { 1, 8, 32, 64, 128, 253 }; // cdnet frame data length
+
+static uint8_t ip_in[IP_HDR_SIZE + CD_FRAME_SIZE];
+static uint8_t ip_out[IP_HDR_SIZE + CD_FRAME_SIZE];
+
+
+// udp from self:0x40 to the class address:0x20 with a correct checksum
+static int ip_build(const addr_class_t *c, int size)
+{
+    struct ipv6 *ipv6 = (struct ipv6 *)ip_in;
+    struct udp *udp = (struct udp *)(ip_in + 40);
+
+    memset(ip_in, 0, IP_HDR_SIZE);
+    ipv6->version = 6;
+    ipv6->hop_limit = 64;
+    ipv6->next_header = IPPROTO_UDP;
+    ipv6->payload_len = htons(size + 8);
+    ipv6->src_ip = *ipv6_self;
+    ipv6->dst_ip = *ipv6_self;
+    memcpy(ipv6->dst_ip.s6_addr + 13, c->addr, 3);
+
+    udp->src_port = htons(0x40);
+    udp->dst_port = htons(0x20);
+    udp->len = htons(size + 8);
+    for (int i = 0; i < size; i++)
+        ip_in[IP_HDR_SIZE + i] = i;
+    udp->check = tcp_udp_v6_checksum(&ipv6->src_ip, &ipv6->dst_ip, IPPROTO_UDP, udp, size + 8);
+    return IP_HDR_SIZE + size;
+}
+
+// the largest payload for the class, from its cdnet header size
+static int class_max(const addr_class_t *c)
+{
+    cdn_pkt_t pkt;
+    cd_frame_t frm;
+    if (ip2frame(&pkt, &frm, ip_in, ip_build(c, 1)))
+        return 0;
+    return CD_FRAME_SIZE - 3 - cdn_hdr_size_pkt(&pkt) - 2; // 2: crc
+}
+
+static int bench_class(const addr_class_t *c)
+{
+    int max_size = class_max(c);
+    if (!max_size) {
+        fprintf(stderr, "conv: %s: no size accepted\n", c->name);
+        return -1;
+    }
+
+    for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        int size = sizes[i] ? sizes[i] : max_size;
+        if (size > max_size)
+            continue;
+        int ip_len = ip_build(c, size);
+        cdn_pkt_t pkt, rx;
+        cd_frame_t frm;
+        int out_len;
+
+        pkt.frm = &frm;
+        if (ip2cdnet(&pkt, ip_in, ip_len) || cdn_frame_w(&pkt)) {
+            fprintf(stderr, "conv: %s: size %d rejected\n", c->name, size);
+            return -1;
+        }
+        rx.frm = &frm;
+        rx._l_net = ipv6_self->s6_addr[14];
+        if (cdn_frame_r(&rx) || rx.len != size) {
+            fprintf(stderr, "conv: %s: size %d: frame_r failed\n", c->name, size);
+            return -1;
+        }
+
+        BENCH_RUN("ip2cdnet", c->name, size, bench_sink += ip2cdnet(&pkt, ip_in, ip_len));
+        BENCH_RUN("cdn_frame_w", c->name, size, bench_sink += cdn_frame_w(&pkt));
+        BENCH_RUN("cdn_frame_r", c->name, size, bench_sink += cdn_frame_r(&rx));
+        BENCH_RUN("cdnet2ip", c->name, size, bench_sink += cdnet2ip(&rx, ip_out, &out_len));
+    }
+    return 0;
+}
+
+static int bench_uart(void)
+{
+    static cd_frame_t frames[4];
+    list_head_t free_head = {0};
+    cduart_dev_t dev;
+    cd_frame_t frm;
+
+    for (int i = 0; i < 4; i++)
+        list_put(&free_head, &frames[i].node);
+    cduart_dev_init(&dev, &free_head);
+
+    for (int n = 0; n < sizeof(lens) / sizeof(lens[0]); n++) {
+        int len = lens[n];
+        int size = len + 5;
+        frm.dat[0] = 0x00;
+        frm.dat[1] = 0xfe;
+        frm.dat[2] = len;
+        for (int i = 0; i < len; i++)
+            frm.dat[3 + i] = i;
+
+        BENCH_RUN("cduart_fill_crc", "-", size, cduart_fill_crc(frm.dat); bench_sink += frm.dat[3 + len]);
+
+        uint32_t rx_cnt = 0;
+        BENCH_RUN("cduart_rx_handle", "-", size, {
+            cduart_rx_handle(&dev, frm.dat, size);
+            cd_frame_t *r = dev.cd_dev.get_rx_frame(&dev.cd_dev);
+            if (r) {
+                rx_cnt++;
+                list_put(&free_head, &r->node);
+            }
+        });
+        if (!rx_cnt) {
+            fprintf(stderr, "conv: cduart_rx_handle: len %d: no frame\n", len);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void bench_cksum(void)
+{
+    struct in6_addr dst = *ipv6_self;
+    dst.s6_addr[15] = 0xfe;
+
+    for (int i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+        int size = lens[i];
+        BENCH_RUN("tcp_udp_v6_checksum", "-", size,
+                bench_sink += tcp_udp_v6_checksum(ipv6_self, &dst, IPPROTO_UDP, ip_in + 40, size + 8));
+    }
+}
+
+
+int main(int argc, char *argv[])
+{
+    inet_pton(AF_INET6, "fdcd::80:00", ipv6_self->s6_addr);
+    route_set(ROUTE_DEFAULT, 0x01, 0); // the router at 80:00:01
+
+    bench_header();
+    for (int i = 0; i < sizeof(classes) / sizeof(classes[0]); i++) {
+        if (bench_class(&classes[i]))
+            return 1;
+    }
+    bench_cksum();
+    if (bench_uart())
+        return 1;
+    return 0;
+}
@@ -0,0 +1,62 @@
+#!/bin/bash
+#
+# End-to-end bench without hardware: cdnet_tun on a pty, a fake cdbus peer
+# echoing every frame, and udp traffic through the tun interface.
+#
+# Runs in its own network namespace, as root or through an unprivileged
+# user namespace, leaves nothing behind on the host.
+#
+# env: BAUDS, SIZES, COUNT, WINDOW, TIME, TUN_ARGS (extra cdnet_tun args)
+#   datagrams over one frame: SIZES=1000,4000 TUN_ARGS="--frag --tun-up"
+# output: csv from udp_echo, the label is the baud rate
+
+cd "$(dirname "$0")/.."
+
+if [ "$CDNET_BENCH_NS" == "" ]; then
+    export CDNET_BENCH_NS=1
+    if [ $UID -eq 0 ]; then
+        exec unshare -n "$0" "$@"
+    fi
+    exec unshare -rn "$0" "$@"
+fi
+
+BAUDS="${BAUDS:-115200 1000000 3000000}"
+SIZES="${SIZES:-8,64,128,240}"
+COUNT="${COUNT:-200}"
+WINDOW="${WINDOW:-8}"
+TIME="${TIME:-2000}"
+
+self6="fdcd::80:00" # 80:00:00
+peer6="fdcd::80:fe" # 80:00:fe
+tun=cdbench0
+dir=$(mktemp -d)
+trap 'kill $(jobs -p) 2>/dev/null; wait; rm -rf "$dir"' EXIT
+
+ip link set lo up
+header="--header"
+
+for baud in $BAUDS; do
+    ./fake_peer --pty "$dir/pty" --baud "$baud" --frag-port 0xfe 2>"$dir/peer_$baud.log" &
+    peer=$!
+    while [ ! -e "$dir/pty" ]; do sleep 0.01; done
+
+    ./cdnet_tun --self6=$self6 --tun $tun --dev-type tty --dev "$dir/pty" \
+            --tty-baud "$baud" $TUN_ARGS 2>"$dir/tun_$baud.log" &
+    gw=$!
+    while ! ip link show $tun >/dev/null 2>&1; do
+        kill -0 $gw 2>/dev/null || { cat "$dir/tun_$baud.log" >&2; exit 1; }
+        sleep 0.01
+    done
+    if [[ "$TUN_ARGS" != *--tun-up* ]]; then
+        ip link set $tun up
+        ip addr add "$self6/64" dev $tun nodad
+    fi
+
+    ./udp_echo --dst $peer6 --sizes "$SIZES" --count "$COUNT" --window "$WINDOW" \
+            --time "$TIME" --label "$baud" $header || exit 1
+    header=""
+
+    kill $gw $peer
+    wait $gw $peer 2>/dev/null
+    while ip link show $tun >/dev/null 2>&1; do sleep 0.01; done
+done
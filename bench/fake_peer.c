@@ -0,0 +1,409 @@
+/*
+ * Software License Agreement (BSD License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <d@d-l.io>
+ */
+
+/*
+ * A fake cdbus_uart peer behind a pseudo-terminal, for the end-to-end bench.
+ *
+ * Every valid frame received is sent back with the cdnet source and
+ * destination swapped, so an udp packet to any address on the bus comes
+ * back to its sender. The bus is emulated as half-duplex at --baud: a frame
+ * occupies the bus for 10 bits per byte, and each echo is delayed until the
+ * request and the echo itself had their time on the bus.
+ *
+ * The slave side of the pty is linked to --pty, give that to cdnet_tun --dev.
+ *
+ * With --frag-port, the fragments to that port (cdnet_tun --frag) are sent
+ * back as fragments: the ports in their header are swapped too, so the
+ * datagram is put together again on the way back.
+ *
+ * With --split-us, each echo is written in two halves, the second one that
+ * many us later, so cdnet_tun gets a frame split across two delayed reads.
+ *
+ * With --ping, the peer originates instead: it sends --count frames one at
+ * a time from a0:<net>:<mac> to the given cdnet address through the gateway
+ * mac --gw, and takes the frames coming back from that address as the
+ * replies, for the bus to bus forwarding bench. Prints one csv line:
+ *   label,size,sent,recv,rtt_p50_us,rtt_p90_us,rtt_p99_us,rtt_max_us
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <termios.h>
+#include "cd_utils.h"
+#include "cd_list.h"
+#include "cdbus.h"
+#include "cdnet.h"
+#include "modbus_crc.h"
+#include "cd_args.h"
+#include "lat_hist.h"
+#include "bench.h"
+
+#define PEND_MAX    512     // echoes waiting for the bus, a few fragmented datagrams
+
+static const char *usage =
+    "usage: fake_peer --pty PATH [--baud 115200] [--net 0] [--frag-port 0xfe]\n"
+    "                 [--split-us 0]\n"
+    "                 [--ping a0:01:fe [--mac 0xfe] [--gw 0] [--size 64]\n"
+    "                  [--count 200] [--wait 500] [--label x] [--header]]\n";
+
+typedef struct {
+    cd_frame_t  frm;
+    uint64_t    due;        // ns
+    int         off;        // bytes written, with --split-us
+} pend_t;
+
+static pend_t pend[PEND_MAX];
+static uint32_t pend_rd, pend_wr;
+
+static uint8_t rx_buf[CD_FRAME_SIZE * 4];
+static int rx_len;
+
+static uint32_t baud;
+static uint8_t net;
+static int frag_port = -1;  // -1: no fragments
+static uint64_t bus_free;   // ns, the time the emulated bus becomes idle
+static uint64_t split_ns;   // 0: echoes written in one go
+static const char *link_path;
+
+static struct {
+    bool        on;
+    uint8_t     dst[3];
+    uint8_t     mac;
+    uint8_t     gw;
+    int         size;
+    uint64_t    seq;        // the one in flight
+    uint64_t    t;          // ns, sent at
+    bool        got;
+    lat_hist_t  h;
+} ping;
+
+static struct {
+    uint32_t    frames;
+    uint32_t    crc_err;
+    uint32_t    bad_pkt;
+    uint32_t    overrun;    // echoes dropped for PEND_MAX
+} st;
+
+
+static uint64_t wire_ns(int bytes)
+{
+    return bytes * 10ULL * 1000000000ULL / baud;
+}
+
+static void on_exit_sig(int sig)
+{
+    unlink(link_path);
+    _exit(0);
+}
+
+// swap the cdnet addresses of frm into out, return -1 if not a cdnet frame
+static int echo_build(cd_frame_t *frm, cd_frame_t *out)
+{
+    cdn_pkt_t pkt = {0};
+    cdn_pkt_t rep = {0};
+
+    pkt.frm = frm;
+    pkt._l_net = net;
+    if (cdn_frame_r(&pkt))
+        return -1;
+
+    rep.src = pkt.dst;
+    rep.dst = pkt.src;
+    rep.len = pkt.len;
+    rep._s_mac = frm->dat[1];
+    rep._d_mac = frm->dat[0];
+    bool frag = pkt.dst.port == frag_port && pkt.len >= 7; // 7: the fragment header
+    if (frag) {
+        rep.src.port = pkt.dat[0] | pkt.dat[1] << 8;
+        rep.dst.port = frag_port;
+    }
+    rep.frm = out;
+    rep.dat = out->dat + 3 + cdn_hdr_size_pkt(&rep);
+    memcpy(rep.dat, pkt.dat, pkt.len);
+    if (frag) {
+        rep.dat[0] = pkt.src.port & 0xff;
+        rep.dat[1] = pkt.src.port >> 8;
+    }
+    if (cdn_frame_w(&rep))
+        return -1;
+
+    uint16_t crc = crc16(out->dat, out->dat[2] + 3);
+    out->dat[out->dat[2] + 3] = crc & 0xff;
+    out->dat[out->dat[2] + 4] = crc >> 8;
+    return 0;
+}
+
+static void ping_rx(cd_frame_t *frm)
+{
+    cdn_pkt_t pkt = {0};
+    uint64_t seq;
+
+    pkt.frm = frm;
+    pkt._l_net = net;
+    if (cdn_frame_r(&pkt) || memcmp(pkt.src.addr, ping.dst, 3) || pkt.len < 8) {
+        st.bad_pkt++;
+        return;
+    }
+    memcpy(&seq, pkt.dat, 8);
+    if (seq == ping.seq && !ping.got) {
+        ping.got = true;
+        lat_hist_add(&ping.h, bench_ns() - ping.t);
+    }
+}
+
+static void ping_tx(int fd)
+{
+    cd_frame_t frm;
+    cdn_pkt_t pkt = {0};
+
+    pkt.src.addr[0] = 0xa0;
+    pkt.src.addr[1] = net;
+    pkt.src.addr[2] = ping.mac;
+    pkt.src.port = 0x40;
+    memcpy(pkt.dst.addr, ping.dst, 3);
+    pkt.dst.port = 0x20;
+    pkt._s_mac = ping.mac;
+    pkt._d_mac = ping.gw;
+    pkt.len = ping.size;
+    pkt.frm = &frm;
+    pkt.dat = frm.dat + 3 + cdn_hdr_size_pkt(&pkt);
+    memcpy(pkt.dat, &ping.seq, 8);
+    for (int i = 8; i < ping.size; i++)
+        pkt.dat[i] = i;
+    if (cdn_frame_w(&pkt)) {
+        fprintf(stderr, "fake_peer: ping: size %d rejected\n", ping.size);
+        exit(1);
+    }
+    uint16_t crc = crc16(frm.dat, frm.dat[2] + 3);
+    frm.dat[frm.dat[2] + 3] = crc & 0xff;
+    frm.dat[frm.dat[2] + 4] = crc >> 8;
+
+    ping.got = false;
+    ping.t = bench_ns();
+    if (write(fd, frm.dat, frm.dat[2] + 5) != frm.dat[2] + 5) {
+        perror("fake_peer: write");
+        exit(1);
+    }
+}
+
+static void rx_parse(void);
+
+// return true if the reply came back in wait_ms
+static bool ping_one(int fd, int wait_ms)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    uint64_t t_end = bench_ns() + wait_ms * 1000000ULL;
+
+    ping_tx(fd);
+    while (!ping.got && bench_ns() < t_end) {
+        if (poll(&pfd, 1, max((int64_t)(t_end - bench_ns()) / 1000000, 1)) <= 0)
+            continue;
+        int ret = read(fd, rx_buf + rx_len, sizeof(rx_buf) - rx_len);
+        if (ret > 0) {
+            rx_len += ret;
+            rx_parse();
+        }
+    }
+    return ping.got;
+}
+
+static void rx_frame(cd_frame_t *frm)
+{
+    int len = frm->dat[2] + 5;
+    uint64_t now = bench_ns();
+
+    st.frames++;
+    if (ping.on) {
+        ping_rx(frm);
+        return;
+    }
+    if (pend_wr - pend_rd >= PEND_MAX) {
+        st.overrun++;
+        return;
+    }
+    pend_t *p = &pend[pend_wr % PEND_MAX];
+    if (echo_build(frm, &p->frm)) {
+        st.bad_pkt++;
+        return;
+    }
+    // the request arrived in one go through the pty, charge its bus time now
+    bus_free = max(bus_free, now) + wire_ns(len);
+    bus_free += wire_ns(p->frm.dat[2] + 5);
+    p->due = bus_free;
+    p->off = 0;
+    pend_wr++;
+}
+
+// split rx_buf into frames, skip a byte to re-sync on a bad crc
+static void rx_parse(void)
+{
+    int pos = 0;
+
+    while (rx_len - pos >= 3) {
+        uint8_t *d = rx_buf + pos;
+        int len = d[2] + 5;
+        if (len > CD_FRAME_SIZE) {
+            st.crc_err++;
+            pos++;
+            continue;
+        }
+        if (rx_len - pos < len)
+            break;
+        if (crc16(d, len) != 0) {
+            st.crc_err++;
+            pos++;
+            continue;
+        }
+        cd_frame_t frm;
+        memcpy(frm.dat, d, len);
+        rx_frame(&frm);
+        pos += len;
+    }
+    memmove(rx_buf, rx_buf + pos, rx_len - pos);
+    rx_len -= pos;
+}
+
+static int tx_due(int fd)
+{
+    uint64_t now = bench_ns();
+
+    while (pend_rd != pend_wr) {
+        pend_t *p = &pend[pend_rd % PEND_MAX];
+        if (p->due > now)
+            return (p->due - now + 999999) / 1000000;
+        int len = p->frm.dat[2] + 5;
+        if (split_ns && !p->off)
+            len /= 2;
+        int ret = write(fd, p->frm.dat + p->off, len - p->off);
+        if (ret < 0 && errno == EAGAIN)
+            return 1;
+        if (ret != len - p->off) {
+            perror("fake_peer: write");
+            exit(1);
+        }
+        if (len != p->frm.dat[2] + 5) {
+            p->off = len; // the rest later
+            p->due = now + split_ns;
+            continue;
+        }
+        pend_rd++;
+    }
+    return -1;
+}
+
+
+int main(int argc, char *argv[])
+{
+    cd_args_t ca;
+    cd_args_parse(&ca, argc, argv);
+    link_path = cd_arg_get(&ca, "--pty");
+    baud = strtol(cd_arg_get_def(&ca, "--baud", "115200"), NULL, 0);
+    net = strtol(cd_arg_get_def(&ca, "--net", "0"), NULL, 0);
+    split_ns = strtol(cd_arg_get_def(&ca, "--split-us", "0"), NULL, 0) * 1000ULL;
+    if (cd_arg_get(&ca, "--frag-port"))
+        frag_port = strtol(cd_arg_get(&ca, "--frag-port"), NULL, 0);
+    const char *ping_str = cd_arg_get(&ca, "--ping");
+    ping.mac = strtol(cd_arg_get_def(&ca, "--mac", "0xfe"), NULL, 0);
+    ping.gw = strtol(cd_arg_get_def(&ca, "--gw", "0"), NULL, 0);
+    ping.size = strtol(cd_arg_get_def(&ca, "--size", "64"), NULL, 0);
+    int count = strtol(cd_arg_get_def(&ca, "--count", "200"), NULL, 0);
+    int wait_ms = strtol(cd_arg_get_def(&ca, "--wait", "500"), NULL, 0);
+    const char *label = cd_arg_get_def(&ca, "--label", "-");
+    unsigned int a[3];
+    if (!link_path || !baud) {
+        fprintf(stderr, "%s", usage);
+        return 1;
+    }
+    if (ping_str) {
+        if (sscanf(ping_str, "%x:%x:%x", &a[0], &a[1], &a[2]) != 3 || ping.size < 8) {
+            fprintf(stderr, "%s", usage);
+            return 1;
+        }
+        for (int i = 0; i < 3; i++)
+            ping.dst[i] = a[i];
+        ping.on = true;
+    }
+
+    int fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0) {
+        perror("fake_peer: openpt");
+        return 1;
+    }
+    struct termios tio;
+    tcgetattr(fd, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(fd, TCSANOW, &tio);
+
+    unlink(link_path);
+    if (symlink(ptsname(fd), link_path) < 0) {
+        perror("fake_peer: symlink");
+        return 1;
+    }
+    signal(SIGINT, on_exit_sig);
+    signal(SIGTERM, on_exit_sig);
+    fprintf(stderr, "fake_peer: %s -> %s, baud %u\n", link_path, ptsname(fd), baud);
+
+    if (ping.on) {
+        // wait for cdnet_tun to open the slave side
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        while (poll(&pfd, 1, 0) >= 0 && (pfd.revents & POLLHUP))
+            usleep(10000);
+
+        // until the path is up, then the measured ones
+        for (int i = 0; i < 10 && !ping_one(fd, wait_ms); i++, ping.seq++);
+        memset(&ping.h, 0, sizeof(ping.h));
+        ping.seq++;
+        for (int i = 0; i < count; i++, ping.seq++)
+            ping_one(fd, wait_ms);
+        if (cd_arg_get(&ca, "--header"))
+            printf("label,size,sent,recv,rtt_p50_us,rtt_p90_us,rtt_p99_us,rtt_max_us\n");
+        printf("%s,%d,%d,%llu,%.1f,%.1f,%.1f,%.1f\n", label, ping.size, count,
+                (unsigned long long)ping.h.total,
+                lat_hist_pct(&ping.h, 50) / 1e3, lat_hist_pct(&ping.h, 90) / 1e3,
+                lat_hist_pct(&ping.h, 99) / 1e3, ping.h.max / 1e3);
+        unlink(link_path);
+        return 0;
+    }
+
+    int timeout = -1;
+    while (true) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        if (poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+            perror("fake_peer: poll");
+            return 1;
+        }
+        // POLLHUP until cdnet_tun opens the slave side
+        if ((pfd.revents & POLLHUP) && !(pfd.revents & POLLIN)) {
+            usleep(10000);
+            continue;
+        }
+        while (pfd.revents & POLLIN) {
+            int ret = read(fd, rx_buf + rx_len, sizeof(rx_buf) - rx_len);
+            if (ret <= 0)
+                break;
+            rx_len += ret;
+            rx_parse();
+        }
+        timeout = tx_due(fd);
+
+        static uint64_t t_last;
+        if (bench_ns() - t_last > 5000000000ULL) {
+            t_last = bench_ns();
+            fprintf(stderr, "fake_peer: frames %u, crc_err %u, bad_pkt %u, overrun %u\n",
+                    st.frames, st.crc_err, st.bad_pkt, st.overrun);
+        }
+    }
+}
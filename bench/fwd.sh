@@ -0,0 +1,88 @@
+#!/bin/bash
+#
+# Bus to bus forwarding bench without hardware: cdnet_tun with two buses on
+# ptys and a fake peer on each.
+#
+#   fwd: the peer on bus0 (net 0) pings a0:01:fe, the peer on bus1 (net 1)
+#        echoes, the gateway forwards each round trip twice in process
+#   tun: udp_echo through the tun to the echoing peer on bus0, the path of
+#        the same traffic if it had to take a round trip through the host
+#
+# The emulated bus time is the same for both, one frame each way through
+# the echoing peer, the difference is the gateway path. The rtt is mostly bus
+# time, the gateway cpu time per round trip (all threads, from schedstat,
+# startup included) is where the paths differ.
+#
+# Runs in its own network namespace, like e2e.sh.
+#
+# env: BAUDS, SIZE, COUNT, TUN_ARGS (extra cdnet_tun args)
+# output: csv: label,size,rtt_p50_us,rtt_p90_us,rtt_p99_us,rtt_max_us,gw_cpu_us
+#         the label is path:baud
+
+cd "$(dirname "$0")/.."
+
+if [ "$CDNET_BENCH_NS" == "" ]; then
+    export CDNET_BENCH_NS=1
+    if [ $UID -eq 0 ]; then
+        exec unshare -n "$0" "$@"
+    fi
+    exec unshare -rn "$0" "$@"
+fi
+
+BAUDS="${BAUDS:-115200 1000000 3000000}"
+SIZE="${SIZE:-64}"
+COUNT="${COUNT:-200}"
+
+tun=cdbench0
+dir=$(mktemp -d)
+trap 'kill $(jobs -p) 2>/dev/null; wait; rm -rf "$dir"' EXIT
+
+ip link set lo up
+
+# start the gateway on the ptys of both peers, $1: log name
+gw_start() {
+    while [ ! -e "$dir/pty0" -o ! -e "$dir/pty1" ]; do sleep 0.01; done
+    ./cdnet_tun --self6=fdcd::80:00 --tun $tun --dev-type tty --dev "$dir/pty0" --tty-baud "$baud" \
+            --bus1 "type=tty,dev=$dir/pty1,net=1" $TUN_ARGS >"$dir/tun_$1.log" 2>&1 &
+    gw=$!
+    while ! ip link show $tun >/dev/null 2>&1; do
+        kill -0 $gw 2>/dev/null || { cat "$dir/tun_$1.log" >&2; exit 1; }
+        sleep 0.01
+    done
+    ip link set $tun up
+    ip addr add "fdcd::80:00/120" dev $tun nodad
+    ip addr add "fdcd::80:0100/120" dev $tun nodad
+}
+
+# cpu time of the gateway per round trip, in us
+gw_cpu() {
+    cat /proc/$gw/task/*/schedstat | awk -v n="$COUNT" '{ s += $1 } END { printf "%.1f\n", s / n / 1000 }'
+}
+
+gw_stop() {
+    kill $gw $(jobs -p) 2>/dev/null
+    wait 2>/dev/null
+    while ip link show $tun >/dev/null 2>&1; do sleep 0.01; done
+    rm -f "$dir/pty0" "$dir/pty1"
+}
+
+echo "label,size,rtt_p50_us,rtt_p90_us,rtt_p99_us,rtt_max_us,gw_cpu_us"
+
+for baud in $BAUDS; do
+    ./fake_peer --pty "$dir/pty0" --baud "$baud" --net 0 2>>"$dir/peer0.log" &
+    ./fake_peer --pty "$dir/pty1" --baud "$baud" --net 1 2>>"$dir/peer1.log" &
+    gw_start "tun_$baud"
+    rtt=$(./udp_echo --dst fdcd::80:fe --sizes "$SIZE" --count "$COUNT" --time 0 \
+            --label "tun:$baud" | cut -d, -f1,2,7-10)
+    echo "$rtt,$(gw_cpu)"
+    gw_stop
+
+    ./fake_peer --pty "$dir/pty1" --baud "$baud" --net 1 2>>"$dir/peer1.log" &
+    ./fake_peer --pty "$dir/pty0" --baud "$baud" --net 0 --ping a0:01:fe --size "$SIZE" \
+            --count "$COUNT" --label "fwd:$baud" >"$dir/ping.csv" 2>>"$dir/peer0.log" &
+    ping=$!
+    gw_start "fwd_$baud"
+    wait $ping
+    echo "$(cut -d, -f1,2,5-8 "$dir/ping.csv"),$(gw_cpu)"
+    gw_stop
+done
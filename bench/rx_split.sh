@@ -0,0 +1,63 @@
+#!/bin/bash
+#
+# Tty rx check without hardware: the fake peer writes each echo in two
+# halves, SPLIT_US apart, longer than the rx gap of cdnet_tun, the way a
+# frame looks when the host is late to read it. No frame may be dropped:
+# every ping comes back, and the tty counts no crc error and no resync.
+#
+# Runs in its own network namespace, like e2e.sh.
+#
+# env: BAUD, SPLIT_US, COUNT, TUN_ARGS (extra cdnet_tun args)
+# output: the udp_echo csv and the tty rx counters, exit 1 on a failure
+
+cd "$(dirname "$0")/.."
+
+if [ "$CDNET_BENCH_NS" == "" ]; then
+    export CDNET_BENCH_NS=1
+    if [ $UID -eq 0 ]; then
+        exec unshare -n "$0" "$@"
+    fi
+    exec unshare -rn "$0" "$@"
+fi
+
+BAUD="${BAUD:-1000000}"
+SPLIT_US="${SPLIT_US:-5000}"
+COUNT="${COUNT:-100}"
+
+self6="fdcd::80:00" # 80:00:00
+peer6="fdcd::80:fe" # 80:00:fe
+tun=cdbench0
+dir=$(mktemp -d)
+trap 'kill $(jobs -p) 2>/dev/null; wait; rm -rf "$dir"' EXIT
+
+ip link set lo up
+./fake_peer --pty "$dir/pty" --baud "$BAUD" --split-us "$SPLIT_US" 2>"$dir/peer.log" &
+while [ ! -e "$dir/pty" ]; do sleep 0.01; done
+
+# line buffered, the counters are dumped on SIGUSR1
+stdbuf -oL ./cdnet_tun --self6=$self6 --tun $tun --dev-type tty --dev "$dir/pty" \
+        --tty-baud "$BAUD" $TUN_ARGS >"$dir/tun.log" 2>&1 &
+gw=$!
+while ! ip link show $tun >/dev/null 2>&1; do
+    kill -0 $gw 2>/dev/null || { cat "$dir/tun.log" >&2; exit 1; }
+    sleep 0.01
+done
+if [[ "$TUN_ARGS" != *--tun-up* ]]; then
+    ip link set $tun up
+    ip addr add "$self6/64" dev $tun nodad
+fi
+
+out=$(./udp_echo --dst $peer6 --sizes 64 --count "$COUNT" --window 1 --time 500 \
+        --label "split_$SPLIT_US" --header 2>&1)
+echo "$out"
+kill -USR1 $gw
+sleep 0.2
+rx=$(grep "rx reads" "$dir/tun.log")
+echo "$rx"
+
+fail=0
+echo "$out" | grep -q "pings lost" && fail=1
+echo "$rx" | grep -q "crc err 0, resync 0," || fail=1
+[ "$rx" != "" ] || fail=1
+[ $fail -eq 0 ] && echo "rx_split: ok" || echo "rx_split: failed"
+exit $fail
@@ -0,0 +1,64 @@
+#!/bin/bash
+#
+# Startup bench without hardware: the time from starting cdnet_tun to the
+# first udp echo from a fake cdbus peer on a pty, with the tun set up by
+# cdnet_tun itself (--tun-up, label netlink) and by ip commands once the
+# tun shows up, as up_tun.sh used to (label ip_cmd).
+#
+# Runs in its own network namespace, as root or through an unprivileged
+# user namespace, leaves nothing behind on the host.
+#
+# env: BAUD, RUNS, TUN_ARGS (extra cdnet_tun args)
+# output: csv from udp_echo --first, one line per run
+
+cd "$(dirname "$0")/.."
+
+if [ "$CDNET_BENCH_NS" == "" ]; then
+    export CDNET_BENCH_NS=1
+    if [ $UID -eq 0 ]; then
+        exec unshare -n "$0" "$@"
+    fi
+    exec unshare -rn "$0" "$@"
+fi
+
+BAUD="${BAUD:-1000000}"
+RUNS="${RUNS:-5}"
+
+self6="fdcd::80:00" # 80:00:00
+peer6="fdcd::80:fe" # 80:00:fe
+tun=cdbench0
+dir=$(mktemp -d)
+trap 'kill $(jobs -p) 2>/dev/null; wait; rm -rf "$dir"' EXIT
+
+ip link set lo up
+./fake_peer --pty "$dir/pty" --baud "$BAUD" 2>"$dir/peer.log" &
+while [ ! -e "$dir/pty" ]; do sleep 0.01; done
+
+gw_stop() {
+    kill $gw 2>/dev/null
+    wait $gw 2>/dev/null
+    while ip link show $tun >/dev/null 2>&1; do sleep 0.01; done
+}
+
+echo "label,startup_ms"
+
+for run in $(seq "$RUNS"); do
+    t0=$(date +%s%N)
+    ./cdnet_tun --self6=$self6 --tun $tun --dev-type tty --dev "$dir/pty" --tty-baud "$BAUD" \
+            --tun-up $TUN_ARGS >"$dir/tun.log" 2>&1 &
+    gw=$!
+    ./udp_echo --dst $peer6 --first "$t0" --label netlink || cat "$dir/tun.log" >&2
+    gw_stop
+
+    t0=$(date +%s%N)
+    ./cdnet_tun --self6=$self6 --tun $tun --dev-type tty --dev "$dir/pty" --tty-baud "$BAUD" \
+            $TUN_ARGS >"$dir/tun.log" 2>&1 &
+    gw=$!
+    ./udp_echo --dst $peer6 --first "$t0" --label ip_cmd &
+    probe=$!
+    while ! ip link show $tun >/dev/null 2>&1; do sleep 0.01; done
+    ip link set $tun up
+    ip addr add "$self6/64" dev $tun
+    wait $probe || cat "$dir/tun.log" >&2
+    gw_stop
+done
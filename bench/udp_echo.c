@@ -0,0 +1,191 @@
+/*
+ * Software License Agreement (BSD License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <d@d-l.io>
+ */
+
+/*
+ * Drive udp traffic to an echoing peer, for the end-to-end bench.
+ *
+ * For each payload size, first ping-pong --count packets one at a time for
+ * the rtt percentiles, then keep --window packets in flight for --time ms
+ * for the throughput. A packet not back in --wait ms is counted as lost.
+ *
+ * Results are printed as csv, one line per size:
+ *   label,size,sent,recv,pps,bytes_per_s,rtt_p50_us,rtt_p90_us,rtt_p99_us,rtt_max_us
+ *
+ * With --first T0, send a probe every ms until the first echo comes back,
+ * for at most --time ms, T0 is the CLOCK_REALTIME in ns the gateway was
+ * started at (date +%s%N). The probes start before the tun exists, so they
+ * go from an unconnected socket, a send error is retried. Prints:
+ *   label,startup_ms
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "lat_hist.h"
+#include "cd_args.h"
+#include "bench.h"
+
+static const char *usage =
+    "usage: udp_echo --dst IPV6 [--port 0x20] [--sizes 8,64,128,240]\n"
+    "                [--count 200] [--window 8] [--time 2000] [--wait 500]\n"
+    "                [--label x] [--header]\n"
+    "       udp_echo --dst IPV6 --first T0_NS [--port 0x20] [--time 2000]\n"
+    "                [--label x] [--header]\n";
+
+static int sock;
+static uint8_t tx_buf[16384]; // up to cdnet_tun --frag-max
+static uint8_t rx_buf[16384];
+
+
+// payload: 8 bytes sequence, then a pattern, return the sequence or -1
+static int64_t rx_one(int size, int wait_ms)
+{
+    struct pollfd pfd = { .fd = sock, .events = POLLIN };
+    if (poll(&pfd, 1, wait_ms) <= 0)
+        return -1;
+    int len = recv(sock, rx_buf, sizeof(rx_buf), 0);
+    if (len != size)
+        return -1;
+    uint64_t seq;
+    memcpy(&seq, rx_buf, 8);
+    return seq;
+}
+
+static void tx_one(int size, uint64_t seq)
+{
+    memcpy(tx_buf, &seq, 8);
+    if (send(sock, tx_buf, size, 0) != size && errno != ENOBUFS && errno != EAGAIN)
+        perror("udp_echo: send");
+}
+
+static void run_size(const char *label, int size, int count, int window,
+        int time_ms, int wait_ms)
+{
+    lat_hist_t h = {0};
+    uint64_t seq = 1, sent = 0, recv_cnt = 0;
+
+    while (recv(sock, rx_buf, sizeof(rx_buf), MSG_DONTWAIT) >= 0); // late echoes
+
+    for (int i = 0; i < count; i++, seq++) {
+        uint64_t t = bench_ns();
+        tx_one(size, seq);
+        int64_t r;
+        while ((r = rx_one(size, wait_ms)) >= 0 && r != seq);
+        if (r == seq)
+            lat_hist_add(&h, bench_ns() - t);
+    }
+
+    int inflight = 0;
+    uint64_t t0 = bench_ns(), t_end = t0 + time_ms * 1000000ULL;
+    while (bench_ns() < t_end) {
+        while (inflight < window) {
+            tx_one(size, seq++);
+            sent++;
+            inflight++;
+        }
+        if (rx_one(size, wait_ms) >= 0)
+            recv_cnt++;
+        inflight--; // an echo, or one given up as lost
+    }
+    double sec = (bench_ns() - t0) / 1e9;
+
+    printf("%s,%d,%llu,%llu,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n", label, size,
+            (unsigned long long)sent, (unsigned long long)recv_cnt,
+            recv_cnt / sec, recv_cnt * size / sec,
+            lat_hist_pct(&h, 50) / 1e3, lat_hist_pct(&h, 90) / 1e3,
+            lat_hist_pct(&h, 99) / 1e3, h.max / 1e3);
+    fflush(stdout);
+    if (h.total < count)
+        fprintf(stderr, "udp_echo: size %d: %llu of %d pings lost\n",
+                size, (unsigned long long)(count - h.total), count);
+}
+
+static uint64_t realtime_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int run_first(const char *label, const struct sockaddr_in6 *addr, uint64_t t0, int time_ms)
+{
+    uint64_t t_end = bench_ns() + time_ms * 1000000ULL;
+    uint64_t seq = 1;
+
+    while (bench_ns() < t_end) {
+        memcpy(tx_buf, &seq, 8);
+        sendto(sock, tx_buf, 8, 0, (struct sockaddr *)addr, sizeof(*addr)); // fails until the tun is up
+        if (rx_one(8, 1) > 0) {
+            printf("%s,%.1f\n", label, (realtime_ns() - t0) / 1e6);
+            return 0;
+        }
+        seq++;
+    }
+    fprintf(stderr, "udp_echo: no echo in %d ms\n", time_ms);
+    return 1;
+}
+
+
+int main(int argc, char *argv[])
+{
+    cd_args_t ca;
+    cd_args_parse(&ca, argc, argv);
+    const char *dst = cd_arg_get(&ca, "--dst");
+    int port = strtol(cd_arg_get_def(&ca, "--port", "0x20"), NULL, 0);
+    const char *sizes = cd_arg_get_def(&ca, "--sizes", "8,64,128,240");
+    int count = strtol(cd_arg_get_def(&ca, "--count", "200"), NULL, 0);
+    int window = strtol(cd_arg_get_def(&ca, "--window", "8"), NULL, 0);
+    int time_ms = strtol(cd_arg_get_def(&ca, "--time", "2000"), NULL, 0);
+    int wait_ms = strtol(cd_arg_get_def(&ca, "--wait", "500"), NULL, 0);
+    const char *label = cd_arg_get_def(&ca, "--label", "-");
+    const char *first = cd_arg_get(&ca, "--first");
+
+    struct sockaddr_in6 addr = { .sin6_family = AF_INET6, .sin6_port = htons(port) };
+    if (!dst || inet_pton(AF_INET6, dst, &addr.sin6_addr) != 1) {
+        fprintf(stderr, "%s", usage);
+        return 1;
+    }
+    if (first) {
+        if ((sock = socket(AF_INET6, SOCK_DGRAM, 0)) < 0) {
+            perror("udp_echo: socket");
+            return 1;
+        }
+        if (cd_arg_get(&ca, "--header"))
+            printf("label,startup_ms\n");
+        return run_first(label, &addr, strtoull(first, NULL, 0), time_ms);
+    }
+    if ((sock = socket(AF_INET6, SOCK_DGRAM, 0)) < 0 ||
+            connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("udp_echo: socket");
+        return 1;
+    }
+    for (int i = 8; i < sizeof(tx_buf); i++)
+        tx_buf[i] = i;
+
+    if (cd_arg_get(&ca, "--header"))
+        printf("label,size,sent,recv,pps,bytes_per_s,rtt_p50_us,rtt_p90_us,rtt_p99_us,rtt_max_us\n");
+
+    const char *s = sizes;
+    while (*s) {
+        char *end;
+        int size = strtol(s, &end, 0);
+        if (end == s || size < 8 || size > sizeof(tx_buf)) {
+            fprintf(stderr, "udp_echo: wrong size: %s\n", s);
+            return 1;
+        }
+        run_size(label, size, count, window, time_ms, wait_ms);
+        s = *end == ',' ? end + 1 : end;
+    }
+    return 0;
+}
@@ -9,15 +9,84 @@
 
 #include <unistd.h>
 #include <time.h>
+#include <sys/uio.h>
 #include <asm/termbits.h>
+#include <linux/serial.h>
 
 #include "cdbus_uart.h"
+#include "modbus_crc.h"
 #include "main.h"
 
 static const char *def_dev = "/dev/ttyACM0";
-static int uart_fd = -1;
 
-static cduart_dev_t cduart_dev = {0};
+// frames are packed into tx_ring and freed at once, tx_ring is flushed by
+// as few writev as possible, waits for POLLOUT if the tty buffer is full;
+// a frame is taken from tx_head only while less than tx_limit bytes are
+// pending, so the frames behind stay in tx_sched and keep their priority.
+// pending counts tx_ring and what the kernel still holds: TIOCOUTQ, or the
+// wire time left from the baudrate if more, as ptys and many usb-serial
+// drivers report 0; the bus is half duplex, rx bytes delay our tx too.
+// if only the kernel holds the frames back, the retry timer runs the task.
+#define TX_RING_SIZE 1024 // power of 2, >= 2 max frame size
+#define TX_LIMIT_US  (DEV_RETRY_US * 4) // the wire never idles between retries
+
+// rx: the gap is seen between read() returns, so it includes the host
+// scheduling jitter. after a gap longer than rx_gap_us inside a frame, the
+// partial frame is dropped at once only if the new bytes start with a whole
+// frame with a good crc, or if the gap exceeds CDUART_IDLE_TIME; otherwise
+// the frame goes on, and only if its crc fails, the bytes after the gap are
+// parsed again as the start of a new frame
+#define RX_GAP_CHARS    4       // inter-byte gap in character times
+#define RX_GAP_MIN_US   2000    // usb-serial adapters deliver in 1 ms packets
+#define RX_FRAME_MAX    (3 + 255 + 2)
+
+#define BUFSIZE 2000
+
+typedef struct {
+    dev_wrapper_t   w;
+    const char      *name;
+    int             fd;
+    cduart_dev_t    cduart_dev;
+
+    uint8_t         tx_ring[TX_RING_SIZE];
+    uint32_t        tx_rd;      // free running
+    uint32_t        tx_wr;
+    bool            tx_blocked;
+    uint32_t        tx_limit;   // bytes pending at most before taking a frame
+    uint32_t        byte_ns;    // wire time of a byte
+    uint64_t        wire_free;  // ns, the end of the bytes written so far on the wire
+
+    struct {
+        uint32_t frames;
+        uint32_t writes;    // writev calls
+        uint64_t bytes;
+        uint32_t again;     // EAGAIN
+        uint32_t partial;   // short writes
+        uint32_t held;      // fills held back by the bytes the kernel still holds
+    } tx_stat;
+
+    uint32_t        rx_gap_us;
+    uint32_t        rx_t_last;
+
+    // frame boundaries, to feed cduart_rx_handle a frame at a time
+    uint16_t        rx_cnt;
+    uint8_t         rx_len;
+
+    // the bytes of the current frame since a gap, parsed again on a crc error
+    bool            rx_gap;
+    uint16_t        rx_tail_len;
+    uint8_t         rx_tail[RX_FRAME_MAX];
+
+    struct {
+        uint32_t reads;
+        uint64_t bytes;
+        uint32_t frames;
+        uint32_t crc_err;   // frames not taken by cduart: crc error or no free frame
+        uint32_t resync;    // partial frames dropped after a gap
+    } rx_stat;
+
+    uint8_t         rx_buf[BUFSIZE];
+} tty_wrapper_t;
 
 
 static int uart_init(int fd, int speed)
@@ -28,16 +97,70 @@ static int uart_init(int fd, int speed)
     tio.c_oflag = 0;
     tio.c_ispeed = speed;
     tio.c_ospeed = speed;
+    // wake on the first byte, VTIME (0.1 s unit) is far too coarse for
+    // framing at any baudrate, the gap timer does it
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
     return ioctl(fd, TCSETS2, &tio);
 }
 
+static void uart_low_latency(int fd)
+{
+    struct serial_struct ss;
+    if (ioctl(fd, TIOCGSERIAL, &ss) == 0) {
+        ss.flags |= ASYNC_LOW_LATENCY;
+        if (ioctl(fd, TIOCSSERIAL, &ss) == 0) {
+            d_info("tty: low latency set\n");
+            return;
+        }
+    }
+    d_warn("tty: set low latency failed: %s\n", strerror(errno));
+}
 
-static void cdbus_tty_tx(void)
+static uint32_t now_us(void)
 {
-    while (true) {
-        cd_frame_t *frm = list_get_entry(&cduart_dev.tx_head, cd_frame_t);
-        if (!frm)
-            break;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000U + ts.tv_nsec / 1000;
+}
+
+
+static void tx_ring_put(tty_wrapper_t *t, const uint8_t *dat, int len)
+{
+    uint32_t ofs = t->tx_wr & (TX_RING_SIZE - 1);
+    int n = min(len, TX_RING_SIZE - ofs);
+    memcpy(t->tx_ring + ofs, dat, n);
+    memcpy(t->tx_ring, dat + n, len - n);
+    t->tx_wr += len;
+}
+
+// bytes in tx_ring and written but not on the wire yet, TIOCOUTQ is only
+// asked if the wire time left is not over tx_limit already
+static uint32_t cdbus_tty_tx_pending(tty_wrapper_t *t)
+{
+    uint64_t now = lat_now();
+    uint32_t pending = t->tx_wr - t->tx_rd;
+    uint32_t est = t->wire_free > now ? (t->wire_free - now) / t->byte_ns : 0;
+    int outq = 0;
+    if (pending + est < t->tx_limit && ioctl(t->fd, TIOCOUTQ, &outq) < 0)
+        outq = 0;
+    return pending + max(est, (uint32_t)outq);
+}
+
+// move frames from tx_head into tx_ring, while less than tx_limit bytes are pending
+// return true if any frame is taken
+static bool cdbus_tty_tx_fill(tty_wrapper_t *t)
+{
+    if (!t->cduart_dev.tx_head.first)
+        return false;
+    uint32_t pending = cdbus_tty_tx_pending(t);
+    if (pending >= t->tx_limit) {
+        t->tx_stat.held++;
+        return false;
+    }
+
+    while (t->cduart_dev.tx_head.first && pending < t->tx_limit) {
+        cd_frame_t *frm = list_get_entry(&t->cduart_dev.tx_head, cd_frame_t);
         cduart_fill_crc(frm->dat);
 
 #ifdef VERBOSE
@@ -45,56 +168,223 @@ static void cdbus_tty_tx(void)
         hex_dump_small(pbuf, frm->dat, frm->dat[2] + 3, 16);
         d_verbose("<- uart tx [%s]\n", pbuf);
 #endif
-        int ret = write(uart_fd, frm->dat, frm->dat[2] + 5);
-        if (ret != frm->dat[2] + 5) {
-            d_error("err: write uart len: %d, ret: %d\n", frm->dat[2] + 5, ret);
+        tx_ring_put(t, frm->dat, frm->dat[2] + 5);
+        pending += frm->dat[2] + 5;
+        t->tx_stat.frames++;
+        TRACE(TR_DEV_OUT, frm);
+        list_put(t->cduart_dev.free_head, &frm->node);
+    }
+    return true;
+}
+
+// return false if the tty buffer is full
+static bool cdbus_tty_tx_flush(tty_wrapper_t *t)
+{
+    while (t->tx_wr != t->tx_rd) {
+        struct iovec iov[2];
+        uint32_t len = t->tx_wr - t->tx_rd;
+        uint32_t ofs = t->tx_rd & (TX_RING_SIZE - 1);
+        iov[0].iov_base = t->tx_ring + ofs;
+        iov[0].iov_len = min(len, TX_RING_SIZE - ofs);
+        iov[1].iov_base = t->tx_ring;
+        iov[1].iov_len = len - iov[0].iov_len;
+
+        int ret = writev(t->fd, iov, iov[1].iov_len ? 2 : 1);
+        t->tx_stat.writes++;
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN) {
+                t->tx_stat.again++;
+                return false;
+            }
+            d_error("err: write uart %s: %s\n", t->name, strerror(errno));
             exit(1);
         }
-        list_put(cduart_dev.free_head, &frm->node);
+        t->tx_rd += ret;
+        t->tx_stat.bytes += ret;
+        t->wire_free = max(t->wire_free, lat_now()) + (uint64_t)ret * t->byte_ns;
+        if (ret < len) {
+            // the tty buffer is full, resume from tx_rd on POLLOUT
+            t->tx_stat.partial++;
+            return false;
+        }
     }
+    return true;
+}
+
+static void cdbus_tty_tx(tty_wrapper_t *t)
+{
+    t->tx_blocked = false;
+    bool more;
+    do {
+        more = cdbus_tty_tx_fill(t);
+        if (!cdbus_tty_tx_flush(t)) {
+            t->tx_blocked = true;
+            return;
+        }
+    } while (more && t->cduart_dev.tx_head.first);
 }
 
 
-#define BUFSIZE 2000
-static uint8_t tmp_buf[BUFSIZE];
+static void cdbus_tty_rx_drop(tty_wrapper_t *t)
+{
+    t->rx_stat.resync++;
+    t->rx_cnt = 0;
+    t->rx_gap = false;
+    t->cduart_dev.rx_byte_cnt = 0;
+    t->cduart_dev.rx_crc = 0xffff;
+}
 
-static void cdbus_tty_rx(void)
+// split buf at the frame ends, only the length byte is looked at here, the
+// crc is checked once by cduart_rx_handle: a complete frame not put on
+// rx_head is counted as a crc error, or parsed again from the gap
+static void cdbus_tty_rx_feed(tty_wrapper_t *t, const uint8_t *buf, int len)
 {
-    int uart_len = read(uart_fd, tmp_buf, BUFSIZE);
-    if (uart_len < 0) {
-        d_error("err: read uart");
-        exit(1);
+    const uint8_t *start = buf;
+
+    while (len) {
+        int need = t->rx_cnt < 3 ? 3 : t->rx_len + 5;
+        int n = min(len, need - t->rx_cnt);
+        if (t->rx_cnt <= 2 && t->rx_cnt + n > 2)
+            t->rx_len = buf[2 - t->rx_cnt];
+        if (t->rx_gap) {
+            memcpy(t->rx_tail + t->rx_tail_len, buf, n);
+            t->rx_tail_len += n;
+        }
+        t->rx_cnt += n;
+        buf += n;
+        len -= n;
+        if (t->rx_cnt == t->rx_len + 5) {
+            uint32_t rx_len = t->cduart_dev.rx_head.len;
+            cduart_rx_handle(&t->cduart_dev, start, buf - start);
+            t->rx_cnt = 0;
+            start = buf;
+            if (t->cduart_dev.rx_head.len != rx_len) {
+                t->rx_stat.frames++;
+                t->rx_gap = false;
+            } else if (t->rx_gap) {
+                // the gap was a frame boundary after all: drop what came before
+                uint8_t tail[RX_FRAME_MAX];
+                int tail_len = t->rx_tail_len;
+                memcpy(tail, t->rx_tail, tail_len);
+                d_debug("tty: crc error after a gap, parse %d bytes again\n", tail_len);
+                cdbus_tty_rx_drop(t);
+                cdbus_tty_rx_feed(t, tail, tail_len);
+            } else {
+                t->rx_stat.crc_err++;
+            }
+        }
     }
-    if (uart_len != 0) {
+    if (buf != start)
+        cduart_rx_handle(&t->cduart_dev, start, buf - start);
+}
+
+// true if buf starts with a whole frame with a good crc
+static bool cdbus_tty_rx_is_frame(const uint8_t *buf, int len)
+{
+    return len >= 5 && buf[2] + 5 <= len && crc16(buf, buf[2] + 5) == 0;
+}
+
+static void cdbus_tty_rx(tty_wrapper_t *t)
+{
+    while (true) {
+        int uart_len = read(t->fd, t->rx_buf, BUFSIZE);
+        if (uart_len < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                return;
+            d_error("err: read uart %s: %s\n", t->name, strerror(errno));
+            exit(1);
+        }
+        if (uart_len == 0)
+            return;
+        t->rx_stat.reads++;
+        t->rx_stat.bytes += uart_len;
+        if (t->wire_free > lat_now()) // our tx waited for these on the bus
+            t->wire_free += (uint64_t)uart_len * t->byte_ns;
+
+        uint32_t now = now_us();
+        uint32_t gap = now - t->rx_t_last;
+        if (t->rx_cnt && gap > t->rx_gap_us) {
+            if (gap > CDUART_IDLE_TIME * CD_SYSTICK_US_DIV || cdbus_tty_rx_is_frame(t->rx_buf, uart_len)) {
+                d_debug("tty: rx gap %u us, drop %d bytes\n", gap, t->rx_cnt);
+                cdbus_tty_rx_drop(t);
+            } else if (!t->rx_gap) {
+                t->rx_gap = true; // maybe only a late read, keep the frame
+                t->rx_tail_len = 0;
+            }
+        }
+        t->rx_t_last = now;
+
         //d_verbose("uart get len: %d\n", uart_len);
-        cduart_rx_handle(&cduart_dev, tmp_buf, uart_len);
+        cdbus_tty_rx_feed(t, t->rx_buf, uart_len);
+        if (uart_len < BUFSIZE)
+            return;
     }
 }
 
-void cdbus_tty_wrapper_task(void)
+static void cdbus_tty_task(dev_wrapper_t *w)
+{
+    tty_wrapper_t *t = (tty_wrapper_t *)w;
+    cdbus_tty_rx(t);
+    cdbus_tty_tx(t);
+}
+
+// true if waiting for the tty to become writable
+static bool cdbus_tty_tx_wait(dev_wrapper_t *w)
+{
+    return ((tty_wrapper_t *)w)->tx_blocked;
+}
+
+static void cdbus_tty_dump(dev_wrapper_t *w)
 {
-    cdbus_tty_rx();
-    cdbus_tty_tx();
+    tty_wrapper_t *t = (tty_wrapper_t *)w;
+    d_info("tty %s: tx frames %u, writev %u (%.2f / frame), bytes %llu, eagain %u, partial %u, held %u, pending %u\n",
+            t->name, t->tx_stat.frames, t->tx_stat.writes,
+            t->tx_stat.frames ? (double)t->tx_stat.writes / t->tx_stat.frames : 0,
+            (unsigned long long)t->tx_stat.bytes, t->tx_stat.again, t->tx_stat.partial, t->tx_stat.held,
+            t->tx_wr - t->tx_rd);
+    d_info("tty %s: rx reads %u, bytes %llu, frames %u, crc err %u, resync %u, gap %u us\n",
+            t->name, t->rx_stat.reads, (unsigned long long)t->rx_stat.bytes, t->rx_stat.frames,
+            t->rx_stat.crc_err, t->rx_stat.resync, t->rx_gap_us);
 }
 
-int cdbus_tty_wrapper_init(const char *dev_name, list_head_t *free_head, uint32_t baudrate)
+// gap_us: 0: from the baudrate
+dev_wrapper_t *cdbus_tty_wrapper_new(const char *dev_name, list_head_t *free_head, uint32_t baudrate, uint32_t gap_us)
 {
-    if (dev_name && *dev_name)
-        def_dev = dev_name;
+    tty_wrapper_t *t = calloc(1, sizeof(tty_wrapper_t));
+    if (!t) {
+        d_error("tty: no memory\n");
+        exit(-1);
+    }
+    t->name = (dev_name && *dev_name) ? dev_name : def_dev;
 
-    d_info("open tty: %s, baudrate: %d\n", def_dev, baudrate);
-    uart_fd = open(def_dev, O_RDWR | O_NOCTTY);
-    if(uart_fd < 0) {
-        d_error("open %s failed\n", def_dev);
+    d_info("open tty: %s, baudrate: %d\n", t->name, baudrate);
+    t->fd = open(t->name, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if(t->fd < 0) {
+        d_error("open %s failed\n", t->name);
         exit(-1);
     }
-    if (uart_init(uart_fd, baudrate)) {
-        d_error("init uart: %s faild!\n", def_dev);
+    if (uart_init(t->fd, baudrate)) {
+        d_error("init uart: %s faild!\n", t->name);
         exit(-1);
     }
+    uart_low_latency(t->fd);
+
+    // 10 bits per character
+    t->byte_ns = max(10 * 1000000000ULL / baudrate, 1);
+    t->tx_limit = max(CD_FRAME_SIZE, TX_LIMIT_US * 1000ULL / t->byte_ns);
+    t->rx_gap_us = gap_us ? gap_us : max(RX_GAP_CHARS * 10 * 1000000ULL / baudrate, RX_GAP_MIN_US);
+    t->rx_gap_us = min(t->rx_gap_us, CDUART_IDLE_TIME * CD_SYSTICK_US_DIV);
+    d_info("tty: rx gap: %u us, tx limit: %u bytes\n", t->rx_gap_us, t->tx_limit);
 
-    cduart_dev_init(&cduart_dev, free_head);
-    cd_dev = &cduart_dev.cd_dev;
-    cd_rx_head = &cduart_dev.rx_head;
-    return uart_fd;
+    cduart_dev_init(&t->cduart_dev, free_head);
+    t->w.fd = t->fd;
+    t->w.cd_dev = &t->cduart_dev.cd_dev;
+    t->w.rx_head = &t->cduart_dev.rx_head;
+    t->w.tx_head = &t->cduart_dev.tx_head;
+    t->w.task = cdbus_tty_task;
+    t->w.tx_wait = cdbus_tty_tx_wait;
+    t->w.dump = cdbus_tty_dump;
+    return &t->w;
 }
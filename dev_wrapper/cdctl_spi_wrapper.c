@@ -7,6 +7,7 @@
  * Author: Duke Fong <d@d-l.io>
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -14,6 +15,7 @@
 #include <string.h>
 #include <gpiod.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <linux/types.h>
@@ -25,18 +27,48 @@
 #define GPIO_CHIP_PATH  "/dev/gpiochip0"
 #define CDCTL_MASK (CDBIT_FLAG_RX_PENDING | CDBIT_FLAG_RX_LOST | \
                     CDBIT_FLAG_RX_ERROR | CDBIT_FLAG_TX_CD | CDBIT_FLAG_TX_ERROR)
-
-static int intn_pin = -1;
-static struct gpiod_line_request *intn_request = NULL;
-static struct gpiod_edge_event_buffer *event_buffer = NULL;
+#define EDGE_BUF_SIZE   16
+#define ROUTINE_MAX     64  // spi_routine calls per task, then retry by timer
+#define XACT_OPS_MAX    8   // register accesses per SPI_IOC_MESSAGE
+#define RX_SPEC_LEN     256 // max frame: 3 + 253
+
+// queue of register accesses, submitted by one SPI_IOC_MESSAGE(n),
+// each access is an address transfer and a data transfer, with CS
+// released in between
+typedef struct {
+    struct spi_ioc_transfer xfer[XACT_OPS_MAX * 2];
+    uint8_t addr[XACT_OPS_MAX];
+    int     n;
+} spi_xact_t;
 
 static uint32_t spi_speed = 20000000; // HZ
-const char *def_dev = "/dev/spidev0.0";
-static spi_t spi_dev = {0};
-
-static cdctl_dev_t cdctl_dev = {0};
-
-static cdctl_cfg_t bus_cfg = {
+static const char *def_dev = "/dev/spidev0.0";
+
+typedef struct {
+    dev_wrapper_t   w;
+    const char      *name;
+    spi_t           spi_dev;
+    cdctl_dev_t     cdctl_dev;
+    cdctl_cfg_t     bus_cfg;
+
+    int             intn_pin;
+    struct gpiod_line_request       *intn_request;
+    struct gpiod_edge_event_buffer  *event_buffer;
+
+    uint8_t         int_mask;
+    spi_xact_t      xact;
+    bool            rx_spec;    // read the frame together with the flags
+
+    struct {
+        uint32_t edges;
+        uint32_t routines;      // spi_routine calls
+        uint32_t ioctls;        // SPI_IOC_MESSAGE
+        uint32_t spec_hit;      // frames read ahead with the flags
+        uint32_t spec_miss;
+    } stat;
+} spi_wrapper_t;
+
+static const cdctl_cfg_t bus_cfg = {
         .mac = 0x00,
         .baud_l = 1000000,
         .baud_h = 10000000,
@@ -48,9 +80,9 @@ static cdctl_cfg_t bus_cfg = {
 };
 
 
-static bool gpio_get_intn(void)
+static bool gpio_get_intn(spi_wrapper_t *s)
 {
-    enum gpiod_line_value value = gpiod_line_request_get_value(intn_request, intn_pin);
+    enum gpiod_line_value value = gpiod_line_request_get_value(s->intn_request, s->intn_pin);
     return value == GPIOD_LINE_VALUE_ACTIVE;
 }
 
@@ -105,23 +137,23 @@ close_chip:
 
 
 
-static int gpio_fd_open(unsigned int offset)
+static int gpio_fd_open(spi_wrapper_t *s, unsigned int offset)
 {
-    intn_request = request_input_line(GPIO_CHIP_PATH, offset, "cdctl-irq");
+    s->intn_request = request_input_line(GPIO_CHIP_PATH, offset, "cdctl-irq");
 
-    if (!intn_request) {
+    if (!s->intn_request) {
         d_error("failed to request line: %s\n", strerror(errno));
         exit(-1);
     }
 
-    int fd = gpiod_line_request_get_fd(intn_request);
+    int fd = gpiod_line_request_get_fd(s->intn_request);
     if (fd < 0) {
         d_error("gpiod_line_request_get_fd faild\n");
         exit(-1);
     }
 
-    event_buffer = gpiod_edge_event_buffer_new(1); // size: 1
-    if (!event_buffer) {
+    s->event_buffer = gpiod_edge_event_buffer_new(EDGE_BUF_SIZE);
+    if (!s->event_buffer) {
         d_error("gpiod_edge_event_buffer_new faild\n");
         exit(-1);
     }
@@ -139,6 +171,7 @@ void spi_mem_write(spi_t *spi, uint8_t mem_addr, const uint8_t *buf, int len)
     xfer[1].tx_buf = (unsigned long)buf;
     xfer[1].len = len;
     status = ioctl(spi->fd, SPI_IOC_MESSAGE(2), xfer);
+    container_of(spi, spi_wrapper_t, spi_dev)->stat.ioctls++;
     if (status < 0) {
         d_error("SPI_IOC_MESSAGE wr\n");
         exit(-1);
@@ -154,12 +187,156 @@ void spi_mem_read(spi_t *spi, uint8_t mem_addr, uint8_t *buf, int len)
     xfer[1].rx_buf = (unsigned long)buf;
     xfer[1].len = len;
     status = ioctl(spi->fd, SPI_IOC_MESSAGE(2), xfer);
+    container_of(spi, spi_wrapper_t, spi_dev)->stat.ioctls++;
     if (status < 0) {
         d_error("SPI_IOC_MESSAGE rd\n");
         exit(-1);
     }
 }
 
+static void xact_add(spi_xact_t *x, uint8_t addr, const uint8_t *tx, uint8_t *rx, int len)
+{
+    struct spi_ioc_transfer *t = &x->xfer[x->n * 2];
+    memset(t, 0, sizeof(*t) * 2);
+    x->addr[x->n] = addr;
+    t[0].tx_buf = (unsigned long)&x->addr[x->n];
+    t[0].len = 1;
+    t[1].tx_buf = (unsigned long)tx;
+    t[1].rx_buf = (unsigned long)rx;
+    t[1].len = len;
+    t[1].cs_change = 1;
+    x->n++;
+}
+
+static inline void xact_read(spi_xact_t *x, uint8_t reg, uint8_t *buf, int len)
+{
+    xact_add(x, reg, NULL, buf, len);
+}
+
+static inline void xact_write(spi_xact_t *x, uint8_t reg, const uint8_t *buf, int len)
+{
+    xact_add(x, reg | 0x80, buf, NULL, len);
+}
+
+static void xact_submit(spi_wrapper_t *s)
+{
+    spi_xact_t *x = &s->xact;
+    if (!x->n)
+        return;
+    x->xfer[x->n * 2 - 1].cs_change = 0; // cs_change on the last one would keep CS asserted
+    int status = ioctl(s->spi_dev.fd, SPI_IOC_MESSAGE(x->n * 2), x->xfer);
+    s->stat.ioctls++;
+    x->n = 0;
+    if (status < 0) {
+        d_error("SPI_IOC_MESSAGE xact\n");
+        exit(-1);
+    }
+}
+
+
+// cdctl_routine with the register accesses batched:
+//   1: [rx pointer reset, flags, rx frame of max length] if rx_spec, else [flags]
+//   (rx frame header, if not read ahead)
+//   2: [rx frame data, rx clear, tx frame, tx start, int mask]
+//      the error flags seen are cleared by the rx / tx control writes, so
+//      they do not keep INTn asserted
+// rx_spec is on while frames keep coming, the read ahead is wasted otherwise
+static void spi_routine(spi_wrapper_t *s)
+{
+    static const uint8_t rx_rst = CDBIT_RX_RST_POINTER;
+    cdctl_dev_t *dev = &s->cdctl_dev;
+    spi_xact_t *xact = &s->xact;
+    cd_frame_t *rx_frm = NULL;
+    cd_frame_t *tx_frm = NULL;
+    uint8_t flags;
+    uint8_t rx_ctrl = 0, tx_ctrl = 0;
+
+    if (s->rx_spec)
+        rx_frm = list_get_entry(dev->free_head, cd_frame_t);
+    if (rx_frm)
+        xact_write(xact, CDREG_RX_CTRL, &rx_rst, 1);
+    xact_read(xact, CDREG_INT_FLAG, &flags, 1);
+    if (rx_frm)
+        xact_read(xact, CDREG_RX, rx_frm->dat, RX_SPEC_LEN);
+    xact_submit(s);
+
+    if (flags & CDBIT_FLAG_RX_LOST)
+        dev->rx_lost_cnt++;
+    if (flags & CDBIT_FLAG_RX_ERROR)
+        dev->rx_error_cnt++;
+    if (flags & CDBIT_FLAG_TX_CD)
+        dev->tx_cd_cnt++;
+    if (flags & CDBIT_FLAG_TX_ERROR)
+        dev->tx_error_cnt++;
+    if (flags & (CDBIT_FLAG_RX_LOST | CDBIT_FLAG_RX_ERROR))
+        rx_ctrl |= CDBIT_RX_CLR_LOST | CDBIT_RX_CLR_ERROR;
+    if (flags & (CDBIT_FLAG_TX_CD | CDBIT_FLAG_TX_ERROR))
+        tx_ctrl |= CDBIT_TX_CLR_CD | CDBIT_TX_CLR_ERROR;
+
+    if (flags & CDBIT_FLAG_RX_PENDING) {
+        if (rx_frm) {
+            s->stat.spec_hit++;
+        } else {
+            rx_frm = list_get_entry(dev->free_head, cd_frame_t);
+            if (rx_frm) {
+                xact_read(xact, CDREG_RX, rx_frm->dat, 3);
+                xact_submit(s);
+                xact_read(xact, CDREG_RX, rx_frm->dat + 3, rx_frm->dat[2]);
+            } else {
+                dev->rx_no_free_node_cnt++;
+            }
+        }
+        if (rx_frm)
+            rx_ctrl |= CDBIT_RX_CLR_PENDING | CDBIT_RX_RST_POINTER;
+        s->rx_spec = true;
+    } else {
+        if (rx_frm) {
+            s->stat.spec_miss++;
+            list_put_begin(dev->free_head, &rx_frm->node);
+            rx_frm = NULL;
+        }
+        s->rx_spec = false;
+    }
+    if (rx_ctrl)
+        xact_write(xact, CDREG_RX_CTRL, &rx_ctrl, 1);
+
+    if (!dev->is_pending) {
+        tx_frm = list_get_entry(&dev->tx_head, cd_frame_t);
+        if (tx_frm) {
+            xact_write(xact, CDREG_TX, tx_frm->dat, tx_frm->dat[2] + 3);
+            if (flags & CDBIT_FLAG_TX_BUF_CLEAN)
+                tx_ctrl |= CDBIT_TX_START | CDBIT_TX_RST_POINTER;
+            else
+                dev->is_pending = true;
+        }
+    } else if (flags & CDBIT_FLAG_TX_BUF_CLEAN) {
+        tx_ctrl |= CDBIT_TX_START | CDBIT_TX_RST_POINTER;
+        dev->is_pending = false;
+    }
+    if (tx_ctrl)
+        xact_write(xact, CDREG_TX_CTRL, &tx_ctrl, 1);
+
+    // a frame waits for the tx buffer of the chip: let it raise INTn
+    // when the buffer is clean, instead of polling the flags
+    uint8_t mask = CDCTL_MASK | (dev->is_pending ? CDBIT_FLAG_TX_BUF_CLEAN : 0);
+    if (mask != s->int_mask) {
+        s->int_mask = mask;
+        xact_write(xact, CDREG_INT_MASK, &s->int_mask, 1);
+    }
+    xact_submit(s);
+
+    if (rx_frm) {
+        list_put(&dev->rx_head, &rx_frm->node);
+        dev->rx_cnt++;
+    }
+    if (tx_frm) {
+        TRACE(TR_DEV_OUT, tx_frm);
+        list_put(dev->free_head, &tx_frm->node);
+        dev->tx_cnt++;
+    }
+}
+
+
 static void spi_dumpstat(spi_t *spi)
 {
     __u8    lsb, bits;
@@ -186,44 +363,105 @@ static void spi_dumpstat(spi_t *spi)
 }
 
 
-void cdctl_spi_wrapper_task(void)
+// consume the pending edges, return the timestamp of the first one, or 0
+static uint64_t read_edges(spi_wrapper_t *s)
 {
-    while (true) {
-        int ret = gpiod_line_request_wait_edge_events(intn_request, 0);
-        if (ret == 1) {
-            ret = gpiod_line_request_read_edge_events(intn_request, event_buffer, 1); // size: 1
-            if (ret == -1) {
-                d_error("error reading edge events: %s\n", strerror(errno));
-            }
-        }
-        cdctl_routine(&cdctl_dev);
-        if (gpio_get_intn() && !cdctl_dev.tx_head.len && !cdctl_dev.is_pending)
+    uint64_t t = 0;
+    while (gpiod_line_request_wait_edge_events(s->intn_request, 0) == 1) {
+        int ret = gpiod_line_request_read_edge_events(s->intn_request, s->event_buffer, EDGE_BUF_SIZE);
+        if (ret <= 0) {
+            d_error("error reading edge events: %s\n", strerror(errno));
             break;
+        }
+        if (!t)
+            t = gpiod_edge_event_get_timestamp_ns(gpiod_edge_event_buffer_get_event(s->event_buffer, 0));
+        s->stat.edges += ret;
     }
+    return t;
+}
+
+// INTn is active low
+static bool work_left(spi_wrapper_t *s)
+{
+    return !gpio_get_intn(s) || (s->cdctl_dev.tx_head.len && !s->cdctl_dev.is_pending);
 }
 
-int cdctl_spi_wrapper_init(const char *dev_name, list_head_t *free_head, int intn)
+// called on INTn edges (the fd of the wrapper), tx kicks and retry timer
+static void cdctl_spi_task(dev_wrapper_t *w)
 {
-    if (dev_name && *dev_name)
-        def_dev = dev_name;
+    spi_wrapper_t *s = (spi_wrapper_t *)w;
+    uint64_t t_edge = read_edges(s);
+    uint32_t no_free = s->cdctl_dev.rx_no_free_node_cnt;
+    int n = 0;
+
+    do {
+        spi_routine(s);
+        if (n++ == 0 && t_edge && w->lat)
+            lat_hist_add(w->lat, lat_now() - t_edge); // gpiod timestamps are CLOCK_MONOTONIC
+    } while (work_left(s) && n < ROUTINE_MAX && s->cdctl_dev.rx_no_free_node_cnt == no_free);
+
+    s->stat.routines += n;
+    read_edges(s); // edges raised by our own work, the level is checked above
+}
+
+// true if INTn is still asserted, e.g. no free frame for rx:
+// no new edge will come, run the task again by the retry timer
+static bool cdctl_spi_busy(dev_wrapper_t *w)
+{
+    return work_left((spi_wrapper_t *)w);
+}
+
+static void cdctl_spi_dump(dev_wrapper_t *w)
+{
+    spi_wrapper_t *s = (spi_wrapper_t *)w;
+    cdctl_dev_t *dev = &s->cdctl_dev;
+    struct rusage ru;
+    uint32_t frames = dev->rx_cnt + dev->tx_cnt;
+    getrusage(RUSAGE_THREAD, &ru);
+    double cpu_us = ru.ru_utime.tv_sec * 1e6 + ru.ru_utime.tv_usec + ru.ru_stime.tv_sec * 1e6 + ru.ru_stime.tv_usec;
+
+    // the thread cpu time is shared by all the buses the thread serves
+    d_info("spi %s: rx %u, tx %u, edges %u, routines %u, no free %u, thread cpu %.1f us / frame\n",
+            s->name, dev->rx_cnt, dev->tx_cnt, s->stat.edges, s->stat.routines,
+            dev->rx_no_free_node_cnt, frames ? cpu_us / frames : 0);
+    d_info("spi %s: ioctl %u (%.2f / frame), read ahead hit %u, miss %u\n",
+            s->name, s->stat.ioctls, frames ? (double)s->stat.ioctls / frames : 0,
+            s->stat.spec_hit, s->stat.spec_miss);
+}
 
-    spi_dev.fd = open(def_dev, O_RDWR);
-    if(spi_dev.fd < 0) {
-        d_error("open %s failed\n", def_dev);
+dev_wrapper_t *cdctl_spi_wrapper_new(const char *dev_name, list_head_t *free_head, int intn)
+{
+    spi_wrapper_t *s = calloc(1, sizeof(spi_wrapper_t));
+    if (!s) {
+        d_error("spi: no memory\n");
+        exit(-1);
+    }
+    s->name = (dev_name && *dev_name) ? dev_name : def_dev;
+    s->bus_cfg = bus_cfg;
+    s->int_mask = CDCTL_MASK;
+
+    s->spi_dev.fd = open(s->name, O_RDWR);
+    if(s->spi_dev.fd < 0) {
+        d_error("open %s failed\n", s->name);
         exit(-1);
     }
-    if (ioctl(spi_dev.fd, SPI_IOC_WR_MAX_SPEED_HZ, &spi_speed) == -1) {
+    if (ioctl(s->spi_dev.fd, SPI_IOC_WR_MAX_SPEED_HZ, &spi_speed) == -1) {
         d_error("can't set spi speed hz\n");
         exit(-1);
     }
-    spi_dumpstat(&spi_dev);
-    intn_pin = intn;
-    int intn_pin_fd = gpio_fd_open(intn);
-
-    cdctl_dev_init(&cdctl_dev, free_head, &bus_cfg, &spi_dev);
-    cd_dev = &cdctl_dev.cd_dev;
-    cd_rx_head = &cdctl_dev.rx_head;
-    cdctl_reg_w(&cdctl_dev, CDREG_INT_MASK, CDCTL_MASK);
-
-    return intn_pin_fd;
+    spi_dumpstat(&s->spi_dev);
+    s->intn_pin = intn;
+    int intn_pin_fd = gpio_fd_open(s, intn);
+
+    cdctl_dev_init(&s->cdctl_dev, free_head, &s->bus_cfg, &s->spi_dev);
+    cdctl_reg_w(&s->cdctl_dev, CDREG_INT_MASK, CDCTL_MASK);
+
+    s->w.fd = intn_pin_fd;
+    s->w.cd_dev = &s->cdctl_dev.cd_dev;
+    s->w.rx_head = &s->cdctl_dev.rx_head;
+    s->w.tx_head = &s->cdctl_dev.tx_head;
+    s->w.task = cdctl_spi_task;
+    s->w.busy = cdctl_spi_busy;
+    s->w.dump = cdctl_spi_dump;
+    return &s->w;
 }
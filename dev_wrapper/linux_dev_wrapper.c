@@ -32,93 +32,178 @@
 #define CDBUS_SET_TX_PRE_LEN        _IOW(CDBUS_MAGIC_NUM, 0x0c, uint8_t)
 
 static const char *def_dev = "/dev/cdbus";
-static int ld_fd = -1;
 
-static cd_dev_t            ld_dev;
-static list_head_t         *ld_free_head;
-static list_head_t         ld_rx_head;
-static list_head_t         ld_tx_head;
+typedef struct {
+    dev_wrapper_t   w;
+    const char      *name;
+    int             fd;
+    cd_dev_t        dev;
+    list_head_t     *free_head;
+    list_head_t     rx_head;
+    list_head_t     tx_head;
+    bool            rx_wait;    // no free frame, stop watching POLLIN
+
+    struct {
+        uint32_t rx;
+        uint32_t tx;
+        uint32_t rx_calls;  // read calls
+        uint32_t tx_calls;  // write calls
+        uint32_t rx_err;    // wrong size
+        uint32_t rx_no_frame;
+        uint32_t tx_err;
+        uint32_t tx_again;
+    } stat;
+} ld_wrapper_t;
 
 
 // member functions
 
 static cd_frame_t *ld_get_rx_frame(cd_dev_t *cd_dev)
 {
-    return list_get_entry(&ld_rx_head, cd_frame_t);
+    ld_wrapper_t *l = container_of(cd_dev, ld_wrapper_t, dev);
+    return list_get_entry(&l->rx_head, cd_frame_t);
 }
 
 static void ld_put_tx_frame(cd_dev_t *cd_dev, cd_frame_t *frame)
 {
-    list_put(&ld_tx_head, &frame->node);
+    ld_wrapper_t *l = container_of(cd_dev, ld_wrapper_t, dev);
+    list_put(&l->tx_head, &frame->node);
 }
 
 
-static uint8_t tmp_buf[256];
-
-void linux_dev_wrapper_task(void)
+// the driver exchanges one frame per read / write, so there is nothing to
+// batch with readv / writev, read straight into the frames instead
+static void ld_rx(ld_wrapper_t *l)
 {
-    long int rx_len = read(ld_fd, tmp_buf, 256);
-    
-    if (rx_len < 0) {
-        //d_verbose("dl: read err, len: %d\n", rx_len);
-
-    } else if (rx_len >= 3 && rx_len == tmp_buf[2] + 3) {
-        cd_frame_t *frame = list_get_entry(ld_free_head, cd_frame_t);
-        if (frame) {
-            memcpy(frame->dat, tmp_buf, min(rx_len, 256));
+    while (true) {
+        cd_frame_t *frame = list_get_entry(l->free_head, cd_frame_t);
+        if (!frame) {
+            // leave the rest queued in the driver, read on after the
+            // received frames are returned
+            l->stat.rx_no_frame++;
+            l->rx_wait = true;
+            return;
+        }
+        l->rx_wait = false;
+
+        long int rx_len = read(l->fd, frame->dat, CD_FRAME_SIZE);
+        l->stat.rx_calls++;
+        if (rx_len < 0) {
+            list_put_begin(l->free_head, &frame->node);
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                return;
+            d_error("dl: read %s: %s\n", l->name, strerror(errno));
+            exit(1);
+        }
+        if (rx_len < 3 || rx_len != frame->dat[2] + 3) {
+            list_put_begin(l->free_head, &frame->node);
+            l->stat.rx_err++;
+            d_error("dl: get_rx, wrong size: %ld\n", rx_len);
+            continue;
+        }
 #ifdef VERBOSE
-            char pbuf[52];
-            hex_dump_small(pbuf, frame->dat, frame->dat[2] + 3, 16);
-            d_verbose("dl: -> [%s]\n", pbuf);
+        char pbuf[52];
+        hex_dump_small(pbuf, frame->dat, frame->dat[2] + 3, 16);
+        d_verbose("dl: -> [%s]\n", pbuf);
 #endif
-            list_put(&ld_rx_head, &frame->node);
-        } else {
-            d_error("dl: get_rx, no free frame\n");
-        }
-    } else {
-        d_error("dl: get_rx, wrong size: %ld\n", rx_len);
+        l->stat.rx++;
+        list_put(&l->rx_head, &frame->node);
     }
-    
-    cd_frame_t *frame = list_get_entry(&ld_tx_head, cd_frame_t);
-    if (frame) {
+}
+
+static void ld_tx(ld_wrapper_t *l)
+{
+    while (l->tx_head.first) {
+        cd_frame_t *frame = list_entry(l->tx_head.first, cd_frame_t);
+        int len = frame->dat[2] + 3;
 #ifdef VERBOSE
         char pbuf[52];
         hex_dump_small(pbuf, frame->dat, frame->dat[2] + 3, 16);
         d_verbose("dl: <- [%s]\n", pbuf);
 #endif
-        write(ld_fd, frame->dat, frame->dat[2] + 3);
-        list_put(ld_free_head, &frame->node);
+        int ret = write(l->fd, frame->dat, len);
+        l->stat.tx_calls++;
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0 && errno == EAGAIN) {
+            // driver tx queue full, keep the frame, the retry timer calls us again
+            // (not POLLOUT, the driver may not report it)
+            l->stat.tx_again++;
+            return;
+        }
+        list_get(&l->tx_head);
+        list_put(l->free_head, &frame->node);
+        if (ret != len) {
+            l->stat.tx_err++;
+            d_error("dl: write len: %d, ret: %d, %s\n", len, ret, ret < 0 ? strerror(errno) : "");
+            if (ret < 0 && (errno == ENODEV || errno == EIO))
+                exit(1);
+            continue;
+        }
+        l->stat.tx++;
+        TRACE(TR_DEV_OUT, frame);
     }
 }
 
-int linux_dev_wrapper_init(const char *dev_name, list_head_t *free_head)
+static void ld_task(dev_wrapper_t *w)
 {
-    if (dev_name && *dev_name)
-        def_dev = dev_name;
+    ld_wrapper_t *l = (ld_wrapper_t *)w;
+    ld_rx(l);
+    ld_tx(l);
+}
 
-    ld_fd = open(def_dev, O_RDWR);
-    if(ld_fd < 0) {
-        d_error("open %s failed\n", def_dev);
+static bool ld_rx_wait(dev_wrapper_t *w)
+{
+    return ((ld_wrapper_t *)w)->rx_wait;
+}
+
+static void ld_dump(dev_wrapper_t *w)
+{
+    ld_wrapper_t *l = (ld_wrapper_t *)w;
+    d_info("dl %s: rx %u (%u reads, %u err, %u no frame), tx %u (%u writes, %u err, %u again)\n",
+            l->name, l->stat.rx, l->stat.rx_calls, l->stat.rx_err, l->stat.rx_no_frame,
+            l->stat.tx, l->stat.tx_calls, l->stat.tx_err, l->stat.tx_again);
+}
+
+dev_wrapper_t *linux_dev_wrapper_new(const char *dev_name, list_head_t *free_head)
+{
+    ld_wrapper_t *l = calloc(1, sizeof(ld_wrapper_t));
+    if (!l) {
+        d_error("dl: no memory\n");
+        exit(-1);
+    }
+    l->name = (dev_name && *dev_name) ? dev_name : def_dev;
+
+    l->fd = open(l->name, O_RDWR | O_NONBLOCK);
+    if(l->fd < 0) {
+        d_error("open %s failed\n", l->name);
         exit(-1);
     }
     
     uint8_t filter;
-    if (ioctl(ld_fd, CDBUS_GET_FILTER, &filter) < 0) {
+    if (ioctl(l->fd, CDBUS_GET_FILTER, &filter) < 0) {
             d_error("ioctl get_filter error");
             exit(-1);
     }
     d_info("ioctl get_filter: %02x\n", filter);
     
-    //if (ioctl(ld_fd, CDBUS_SET_FILTER, 0) < 0) {
+    //if (ioctl(l->fd, CDBUS_SET_FILTER, 0) < 0) {
     //        d_error("ioctl set_filter error");
     //        exit(-1);
     //}
 
-    ld_free_head = free_head;
-    ld_dev.get_rx_frame = ld_get_rx_frame;
-    ld_dev.put_tx_frame = ld_put_tx_frame;
-
-    cd_dev = &ld_dev;
-    cd_rx_head = &ld_rx_head;
-    return ld_fd;
+    l->free_head = free_head;
+    l->dev.get_rx_frame = ld_get_rx_frame;
+    l->dev.put_tx_frame = ld_put_tx_frame;
+
+    l->w.fd = l->fd;
+    l->w.cd_dev = &l->dev;
+    l->w.rx_head = &l->rx_head;
+    l->w.tx_head = &l->tx_head;
+    l->w.task = ld_task;
+    l->w.rx_wait = ld_rx_wait;
+    l->w.dump = ld_dump;
+    return &l->w;
 }
@@ -16,6 +16,7 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "main.h"
@@ -26,132 +27,760 @@
 //   map 3 bytes CDNET address format to ipv6 last 3 bytes
 
 static struct in6_addr _ipv6_self = {0};
-static struct in6_addr _default_router6 = {0};
 
 struct in6_addr *ipv6_self = &_ipv6_self;
-struct in6_addr *default_router6 = &_default_router6;
-bool has_router6 = false;
 uint16_t port_offset = 0;
+bool tun_vnet_hdr = false; // tun packets carry a struct virtio_net_hdr
+bool bus_fwd = true;       // forward unique local frames between the buses in process
+bool ip_frag = false;      // split udp datagrams larger than a frame, see ip_frag_init
+uint16_t frag_port = FRAG_PORT_DEF;
 
+// multi-bus: the bus serving each net, registered by ip_bus_add;
+// none registered (e.g. replay): bus 0 serves the net of ipv6_self
+static int8_t net_bus[256];
+static uint8_t bus_net[GW_BUS_MAX];
+static int bus_num = 0;
 
-int ip2cdnet(cdn_pkt_t *pkt, const uint8_t *ip_dat, int ip_len)
+// fragmentation (--frag), see ip_frag_init:
+//   a udp datagram too large for one frame is split into fragments sent to
+//   frag_port, each one carries FRAG_HDR_SIZE bytes in front of its data:
+//     dst_port (2), id (1), offset (2), total length (2), little endian
+//   the fragments are all sent on FRAG_CLASS, one datagram after another;
+//   the receiver puts them together per source (bus, address and port) and
+//   id, in order: a missing fragment drops the datagram, so does no fragment
+//   for more than the timeout.
+
+typedef struct {
+    bool        used;
+    uint8_t     bus;
+    uint8_t     addr[3];    // the source
+    uint16_t    port;
+    uint8_t     id;
+    uint16_t    dst_port;   // of the datagram
+    uint16_t    total;
+    uint16_t    off;        // bytes received so far
+    uint64_t    t;          // ns, the last fragment
+    uint8_t     *buf;
+} frag_slot_t;
+
+static struct {
+    int         max;        // max datagram size
+    uint64_t    timeout;    // ns
+    uint8_t     id;         // of the next datagram sent, by the tun reading thread
+    frag_slot_t slot[FRAG_SLOT_NUM]; // by the tun writing thread
+} frag;
+
+// flow cache:
+//   direct-mapped by the low bits of (net, mac) of the remote node,
+//   entries are tagged with (type, net, mac) and dropped by bumping flow_gen
+
+#define FLOW_CACHE_SIZE     1024
+#define FLOW_IDX(net, mac)  ((((net) & 3) << 8) | (mac))
+
+// outbound: resolved cdnet addresses for a destination, used by the tun reading thread
+typedef struct {
+    bool        valid;
+    uint8_t     type;   // ipv6 s6_addr[13]
+    uint8_t     net;
+    uint8_t     mac;
+    uint32_t    gen;
+    uint8_t     src[3];
+    uint8_t     dst[3];
+    uint8_t     s_mac;
+    uint8_t     d_mac;
+    uint8_t     bus;    // the bus to send on
+    int16_t     route;  // index in route_tbl, -1: not routed
+    const char  *drop_msg; // not NULL: no way to this destination
+    drop_reason_t drop;
+} flow_out_t;
+
+// inbound: ipv6 header template for a source, used by the tun writing thread
+typedef struct {
+    bool        valid;
+    uint8_t     type;   // cdnet addr[0]
+    uint8_t     net;
+    uint8_t     mac;
+    uint8_t     bus;    // the bus received from, gives the local net
+    uint32_t    gen;
+    u64         psum;   // pseudo-header partial sum, without the length
+    struct ipv6 hdr;
+} flow_in_t;
+
+static flow_out_t flow_out[FLOW_CACHE_SIZE];
+static flow_in_t flow_in[FLOW_CACHE_SIZE];
+// bumped with release after the route table stores (another thread at
+// runtime), loaded with acquire before a fill reads the table; the cache
+// hit checks load it relaxed, a stale generation only delays the refill
+static _Atomic uint32_t flow_gen = 1;
+
+
+// call after ipv6_self, the routes, port_offset or the buses changed
+void flow_cache_flush(void)
+{
+    atomic_fetch_add_explicit(&flow_gen, 1, memory_order_release);
+}
+
+// bus: 0 .. GW_BUS_MAX-1, registered in order, each bus serves one net
+int ip_bus_add(int bus, uint8_t net)
+{
+    if (!bus_num)
+        memset(net_bus, -1, sizeof(net_bus));
+    if (bus != bus_num || bus >= GW_BUS_MAX || net_bus[net] >= 0)
+        return -1;
+    net_bus[net] = bus;
+    bus_net[bus] = net;
+    bus_num++;
+    flow_cache_flush();
+    return 0;
+}
+
+// the number of buses, none registered: bus 0
+int ip_bus_count(void)
+{
+    return bus_num ? bus_num : 1;
+}
+
+// return the bus serving the net, -1: none
+int ip_net_bus(uint8_t net)
+{
+    if (!bus_num)
+        return net == ipv6_self->s6_addr[14] ? 0 : -1;
+    return net_bus[net];
+}
+
+static uint8_t bus_to_net(int bus)
+{
+    return bus_num ? bus_net[bus] : ipv6_self->s6_addr[14];
+}
+
+static void flow_out_fill(flow_out_t *f, uint8_t type, uint8_t net, uint8_t mac)
+{
+    f->gen = atomic_load_explicit(&flow_gen, memory_order_acquire);
+    int bus = ip_net_bus(net);
+
+    f->valid = true;
+    f->type = type;
+    f->net = net;
+    f->mac = mac;
+    f->bus = 0;
+    f->route = -1;
+    f->drop_msg = NULL;
+
+    if (type != 0x80 && type != 0xa0 && type != 0xf0 && type != 0x00) {
+        f->drop_msg = "< ip: cdnet match failed, skip...\n";
+        f->drop = DROP_NO_ROUTE;
+        return;
+    }
+
+    f->s_mac = ipv6_self->s6_addr[15];
+    f->src[1] = ipv6_self->s6_addr[14];
+    f->src[2] = f->s_mac;
+
+    f->dst[1] = net;
+    f->dst[2] = mac;
+
+    if (type == 0x00) {
+        // l0 local link
+        f->src[0] = 0x00;
+        f->dst[0] = 0x00;
+        f->d_mac = mac;
+
+    } else if (type == 0xf0) {
+        // l1 multicast
+        f->src[0] = 0xa0;
+        f->dst[0] = 0xf0;
+        f->d_mac = mac;
+
+    } else if (bus >= 0) {
+        // l1 local link, on the bus serving the net
+        f->src[0] = 0x80;
+        f->dst[0] = 0x80;
+        f->src[1] = net;
+        f->d_mac = mac;
+        f->bus = bus;
+
+    } else {
+        // l1 unique local, through the router of the net, see route.h
+        f->src[0] = 0xa0;
+        f->dst[0] = 0xa0;
+
+        f->route = route_lookup(net, &f->d_mac, &bus);
+        if (f->route < 0) {
+            f->drop_msg = "< ip: no route, skip...\n";
+            f->drop = DROP_NO_ROUTER;
+            return;
+        }
+        f->bus = bus;
+        f->src[1] = bus_to_net(bus);
+    }
+}
+
+static void flow_in_fill(flow_in_t *f, const cdn_pkt_t *pkt, int bus)
+{
+    struct ipv6 *ipv6 = &f->hdr;
+
+    f->valid = true;
+    f->gen = atomic_load_explicit(&flow_gen, memory_order_acquire);
+    f->type = pkt->src.addr[0];
+    f->net = pkt->src.addr[1];
+    f->mac = pkt->src.addr[2];
+    f->bus = bus;
+
+    memset(ipv6, 0, sizeof(*ipv6));
+    ipv6->version = 6;
+    ipv6->hop_limit = 255;
+    ipv6->next_header = IPPROTO_UDP;
+
+    memcpy(ipv6->src_ip.s6_addr, ipv6_self->s6_addr, 13);
+    ipv6->src_ip.s6_addr[13] = pkt->src.addr[0];
+    ipv6->src_ip.s6_addr[14] = pkt->src.addr[1];
+    ipv6->src_ip.s6_addr[15] = pkt->src.addr[2];
+    memcpy(ipv6->dst_ip.s6_addr, ipv6_self->s6_addr, 16);
+    ipv6->dst_ip.s6_addr[14] = bus_to_net(bus); // our address on the bus
+    if (pkt->src.addr[0] == 0)
+        ipv6->dst_ip.s6_addr[13] = 0; // l0 address
+
+    f->psum = tcp_udp_v6_pseudo_partial(&ipv6->src_ip, &ipv6->dst_ip, ipv6->next_header);
+}
+
+
+// parse the ipv6 and udp header (IP_HDR_SIZE bytes), fill pkt except the payload
+//   bus: optional, output the bus to send on
+// return 0: ok, -1: drop, 1: larger than a frame, to be fragmented (ip_frag)
+static int ip2cdnet_hdr(cdn_pkt_t *pkt, const uint8_t *ip_dat, int ip_len, int *bus)
 {
     struct ipv6 *ipv6 = (struct ipv6 *)ip_dat;
 
+    if (ip_len < IP_HDR_SIZE) {
+        d_warn("< ip: too short: %d, skip...\n", ip_len);
+        stats_drop(DROP_IP_SHORT);
+        return -1;
+    }
     if (ipv6->version != 6) {
         d_error("< ip: wrong ip version: %d\n", ipv6->version);
+        stats_drop(DROP_IP_VERSION);
         return -1;
     }
     if (IN6_IS_ADDR_UNSPECIFIED(&ipv6->src_ip)) {
         d_verbose("< ip: skip UNSPECIFIED ADDR...\n");
+        stats_drop(DROP_IP_UNSPEC);
         return -1;
     }
     if (IN6_IS_ADDR_MULTICAST(&ipv6->dst_ip)) {
         d_verbose("< ip: skip un-support multicast...\n");
+        stats_drop(DROP_IP_MCAST);
         return -1;
     }
 
     if (memcmp(ipv6->dst_ip.s6_addr, ipv6_self->s6_addr, 13) != 0) {
         d_debug("< ip: /104 not match, skip...\n");
+        stats_drop(DROP_NOT_MATCH);
         return -1;
     }
-    if (ipv6->dst_ip.s6_addr[13] != 0x80 && ipv6->dst_ip.s6_addr[13] != 0xa0
-            && ipv6->dst_ip.s6_addr[13] != 0xf0 && ipv6->dst_ip.s6_addr[13] != 0x00) {
-        d_debug("< ip: cdnet match failed, skip...\n");
+    const uint8_t *d = ipv6->dst_ip.s6_addr;
+    flow_out_t *f = &flow_out[FLOW_IDX(d[14], d[15])];
+    if (!f->valid || f->gen != atomic_load_explicit(&flow_gen, memory_order_relaxed) ||
+            f->type != d[13] || f->net != d[14] || f->mac != d[15])
+        flow_out_fill(f, d[13], d[14], d[15]);
+    if (f->drop_msg) {
+        d_debug("%s", f->drop_msg);
+        stats_drop(f->drop);
         return -1;
     }
-
-    pkt->_s_mac = ipv6_self->s6_addr[15];
-    pkt->src.addr[1] = ipv6_self->s6_addr[14];
-    pkt->src.addr[2] = pkt->_s_mac;
-
-    pkt->dst.addr[1] = ipv6->dst_ip.s6_addr[14];
-    pkt->dst.addr[2] = ipv6->dst_ip.s6_addr[15];
-
-    if (ipv6->dst_ip.s6_addr[13] == 0x00) {
-        // l0 local link
-        pkt->src.addr[0] = 0x00;
-        pkt->dst.addr[0] = 0x00;
-        pkt->_d_mac = pkt->dst.addr[2];
-
-    } else if (ipv6->dst_ip.s6_addr[13] == 0xf0) {
-        // l1 multicast
-        pkt->src.addr[0] = 0xa0;
-        pkt->dst.addr[0] = 0xf0;
-        pkt->_d_mac = pkt->dst.addr[2];
-
-    } else if (ipv6->dst_ip.s6_addr[14] == ipv6_self->s6_addr[14]) {
-        // l1 local link
-        pkt->src.addr[0] = 0x80;
-        pkt->dst.addr[0] = 0x80;
-        pkt->_d_mac = pkt->dst.addr[2];
-
-    } else {
-        // l1 unique local
-        pkt->src.addr[0] = 0xa0;
-        pkt->dst.addr[0] = 0xa0;
-
-        if (!has_router6) {
-            d_debug("< ip: no router, skip...\n");
-            return -1;
-        }
-        pkt->_d_mac = default_router6->s6_addr[15];
-    }
+    memcpy(pkt->src.addr, f->src, 3);
+    memcpy(pkt->dst.addr, f->dst, 3);
+    pkt->_s_mac = f->s_mac;
+    pkt->_d_mac = f->d_mac;
+    if (bus)
+        *bus = f->bus;
+    if (f->route >= 0)
+        STAT_ADD(route_tbl[f->route].hits, 1);
 
     if (ipv6->next_header != IPPROTO_UDP) {
         d_warn("< ip: not UDP, skip...\n");
+        stats_drop(DROP_NOT_UDP);
         return -1;
     }
 
     struct udp *udp = (struct udp *)(ip_dat + 40);
     if (ntohs(udp->src_port) < port_offset) {
         d_warn("< ip: udp src_port < port_offset, skip...\n");
+        stats_drop(DROP_PORT_OFFSET);
         return -1;
     }
     pkt->src.port = ntohs(udp->src_port) - port_offset;
     pkt->dst.port = ntohs(udp->dst_port);
     pkt->len = ntohs(udp->len) - 8; // 8: udp header
-    pkt->dat = pkt->frm->dat + 3 + cdn_hdr_size_pkt(pkt);
-    memcpy(pkt->dat, ip_dat + 40 + 8, pkt->len);
+    if (ntohs(udp->len) < 8 || pkt->len > ip_len - IP_HDR_SIZE) {
+        d_warn("< ip: wrong udp len: %d, skip...\n", ntohs(udp->len));
+        stats_drop(DROP_UDP_LEN);
+        return -1;
+    }
+    if (3 + cdn_hdr_size_pkt(pkt) + pkt->len + 2 > CD_FRAME_SIZE) { // 2: crc
+        if (ip_frag && pkt->len <= frag.max)
+            return 1; // for ip_read_frame to split
+        d_warn("< ip: udp dat_len %d exceed frame size, skip...\n", pkt->len);
+        stats_drop(DROP_TOO_BIG);
+        return -1;
+    }
     d_verbose("< ip2cdnet: udp port: %d - %d -> %d, dat_len: %d\n",
             ntohs(udp->src_port), port_offset, pkt->dst.port, pkt->len);
     return 0;
 }
 
-int cdnet2ip(cdn_pkt_t *pkt, uint8_t *ip_dat, int *ip_len)
+int ip2cdnet(cdn_pkt_t *pkt, const uint8_t *ip_dat, int ip_len)
+{
+    int ret = ip2cdnet_hdr(pkt, ip_dat, ip_len, NULL);
+    if (ret > 0)
+        stats_drop(DROP_TOO_BIG); // no fragmentation here
+    if (ret)
+        return -1;
+    pkt->dat = pkt->frm->dat + 3 + cdn_hdr_size_pkt(pkt);
+    memcpy(pkt->dat, ip_dat + IP_HDR_SIZE, pkt->len);
+    return 0;
+}
+
+// build the ipv6 and udp header (IP_HDR_SIZE bytes) for the payload at pkt->dat
+//   csum_partial: only fill in the pseudo-header sum, for checksum offload
+static void cdnet2ip_hdr(cdn_pkt_t *pkt, uint8_t *ip_dat, bool csum_partial, int bus)
 {
     struct ipv6 *ipv6 = (struct ipv6 *)ip_dat;
     struct udp *udp = (struct udp *)(ip_dat + 40);
 
-    ipv6->version = 6;
-    ipv6->traffic_class_hi = 0;
-    ipv6->traffic_class_lo = 0;
-    ipv6->flow_label_hi = 0;
-    ipv6->flow_label_lo = htons(0);
-    ipv6->hop_limit = 255;
-
-    memcpy(ipv6->src_ip.s6_addr, ipv6_self->s6_addr, 13);
-    ipv6->src_ip.s6_addr[13] = pkt->src.addr[0];
-    ipv6->src_ip.s6_addr[14] = pkt->src.addr[1];
-    ipv6->src_ip.s6_addr[15] = pkt->src.addr[2];
-    memcpy(ipv6->dst_ip.s6_addr, ipv6_self->s6_addr, 16);
-    if (pkt->src.addr[0] == 0)
-        ipv6->dst_ip.s6_addr[13] = 0; // l0 address
+    flow_in_t *f = &flow_in[FLOW_IDX(pkt->src.addr[1], pkt->src.addr[2])];
+    if (!f->valid || f->gen != atomic_load_explicit(&flow_gen, memory_order_relaxed) ||
+            f->type != pkt->src.addr[0] || f->net != pkt->src.addr[1] ||
+            f->mac != pkt->src.addr[2] || f->bus != bus)
+        flow_in_fill(f, pkt, bus);
+    memcpy(ipv6, &f->hdr, 40);
 
-    ipv6->next_header = IPPROTO_UDP;
     udp->src_port = htons(pkt->src.port);
     udp->dst_port = htons(pkt->dst.port + port_offset);
     udp->check = 0;
     udp->len = htons(pkt->len + 8);
     ipv6->payload_len = udp->len;
-    *ip_len = pkt->len + 8 + 40;
-
-    memcpy(ip_dat + 40 + 8, pkt->dat, pkt->len);
 
-    udp->check = tcp_udp_v6_checksum(&ipv6->src_ip, &ipv6->dst_ip,
-            ipv6->next_header, ip_dat + 40, ntohs(ipv6->payload_len));
+    if (csum_partial)
+        udp->check = tcp_udp_v6_pseudo_cached(f->psum, pkt->len + 8);
+    else
+        udp->check = tcp_udp_v6_checksum_cached(f->psum, udp, 8, pkt->dat, pkt->len);
 
     d_verbose("> cdnet2ip: udp port: %d -> %d + %d, dat_len: %d, cksum: %04x\n",
             pkt->src.port, pkt->dst.port, port_offset, pkt->len, udp->check);
+}
+
+int cdnet2ip(cdn_pkt_t *pkt, uint8_t *ip_dat, int *ip_len)
+{
+    cdnet2ip_hdr(pkt, ip_dat, false, 0);
+    memcpy(ip_dat + IP_HDR_SIZE, pkt->dat, pkt->len);
+    *ip_len = IP_HDR_SIZE + pkt->len;
+    return 0;
+}
+
+
+// ip packet -> cdnet frame, the frame stays owned by the caller
+int ip2frame(cdn_pkt_t *pkt, cd_frame_t *frm, const uint8_t *ip_dat, int ip_len)
+{
+    pkt->frm = frm;
+    if (ip2cdnet(pkt, ip_dat, ip_len)) {
+        d_debug("-<-: ip2cdnet drop\n");
+        return -1;
+    }
+    if (cdn_frame_w(pkt)) { // addition in: _s_mac, _d_mac
+        d_debug("-<-: to_frame error, drop\n");
+        stats_drop(DROP_TO_FRAME);
+        return -1;
+    }
+    return 0;
+}
+
+// cdnet frame -> ip packet, the frame stays owned by the caller
+int frame2ip(cdn_pkt_t *pkt, cd_frame_t *frm, uint8_t *ip_dat, int *ip_len)
+{
+    pkt->frm = frm;
+    pkt->_l_net = ipv6_self->s6_addr[14];
+    if (cdn_frame_r(pkt)) { // addition in: _l_net
+        d_debug("->-: from_frame error, drop\n");
+        stats_drop(DROP_FROM_FRAME);
+        return -1;
+    }
+    if (cdnet2ip(pkt, ip_dat, ip_len)) {
+        d_debug("->-: cdnet2ip drop\n");
+        return -1;
+    }
+    return 0;
+}
+
+
+// max: the largest udp payload to split or put together
+int ip_frag_init(int max, int timeout_ms)
+{
+    frag.max = max;
+    frag.timeout = timeout_ms * 1000000ULL;
+    for (int i = 0; i < FRAG_SLOT_NUM; i++) {
+        frag.slot[i].buf = malloc(frag.max);
+        if (!frag.slot[i].buf) {
+            d_error("frag: no memory for %d slots of %d bytes\n", FRAG_SLOT_NUM, frag.max);
+            return -1;
+        }
+    }
+    ip_frag = true;
+    return 0;
+}
+
+// a fragment received, by the tun writing thread
+// return 0: the datagram is complete, pkt refers to it, 1: wait for more, -1: drop
+static int frag_input(cdn_pkt_t *pkt, int bus)
+{
+    const uint8_t *h = pkt->dat;
+    int len = pkt->len - FRAG_HDR_SIZE;
+    uint64_t now = lat_now();
+    frag_slot_t *s = NULL, *idle = NULL, *old = NULL;
+
+    if (len <= 0) {
+        stats_drop(DROP_FRAG);
+        return -1;
+    }
+    uint16_t dst_port = h[0] | h[1] << 8;
+    uint8_t id = h[2];
+    uint16_t off = h[3] | h[4] << 8;
+    uint16_t total = h[5] | h[6] << 8;
+
+    // expire all the stale slots first, the scan below stops at a match
+    for (int i = 0; i < FRAG_SLOT_NUM; i++) {
+        frag_slot_t *e = &frag.slot[i];
+        if (e->used && now - e->t > frag.timeout) {
+            d_debug("frag: %02x:%02x:%02x:%d, id %d: timeout\n", e->addr[0], e->addr[1], e->addr[2], e->port, e->id);
+            e->used = false;
+            stats_drop(DROP_FRAG);
+        }
+    }
+    for (int i = 0; i < FRAG_SLOT_NUM; i++) {
+        frag_slot_t *e = &frag.slot[i];
+        if (!e->used) {
+            idle = idle ? idle : e;
+        } else if (e->bus == bus && e->port == pkt->src.port && e->id == id && !memcmp(e->addr, pkt->src.addr, 3)) {
+            s = e;
+            break;
+        } else if (!old || e->t < old->t) {
+            old = e;
+        }
+    }
+
+    if (s && (s->off != off || s->total != total)) {
+        d_debug("frag: id %d, off %d: expect off %d, drop\n", id, off, s->off);
+        s->used = false; // the rest of the previous one lost
+        stats_drop(DROP_FRAG);
+        if (off)
+            return -1;
+    }
+    if (!s || !s->used) {
+        if (off || total > frag.max || total <= len) {
+            stats_drop(DROP_FRAG);
+            return -1;
+        }
+        if (!s)
+            s = idle;
+        if (!s) {
+            s = old; // all busy, give up the oldest
+            stats_drop(DROP_FRAG);
+        }
+        s->used = true;
+        s->bus = bus;
+        memcpy(s->addr, pkt->src.addr, 3);
+        s->port = pkt->src.port;
+        s->id = id;
+        s->dst_port = dst_port;
+        s->total = total;
+        s->off = 0;
+        s->t = now;
+    }
+    if (off + len > total) {
+        s->used = false;
+        stats_drop(DROP_FRAG);
+        return -1;
+    }
+
+    memcpy(s->buf + off, h + FRAG_HDR_SIZE, len);
+    s->off += len;
+    s->t = now;
+    if (s->off < total)
+        return 1;
+    s->used = false; // the buffer stays valid until the next fragment
+    pkt->dat = s->buf;
+    pkt->len = total;
+    pkt->dst.port = s->dst_port;
+    STAT_ADD(stats.frag_rx, 1);
+    return 0;
+}
+
+
+// gso super packet from the tun (--tun-offload), or a datagram to fragment,
+// split into frames over several ip_read_frame calls; only the tun reading
+// thread touches this
+static struct {
+    uint8_t     buf[CD_FRAME_SIZE + GSO_BUF_SIZE]; // readv target at offset CD_FRAME_SIZE
+    uint8_t     *dat;   // the rest segments
+    int         left;
+    int         seg;
+    int         cls;
+    int         bus;
+    cdn_pkt_t   pkt;    // addresses and ports shared by all segments
+    bool        frag;   // segments are fragments, with a header
+    uint16_t    frag_port;  // the dst port of the datagram
+    uint16_t    frag_off;
+    uint16_t    frag_total;
+} gso;
+
+bool ip_read_pending(void)
+{
+    return gso.left > 0;
+}
+
+static int gso_next(cdn_pkt_t *pkt, cd_frame_t *frm, int *ip_len, int *cls, int *bus)
+{
+    int n = min(gso.left, gso.seg);
+    int hdr = 0;
+
+    *pkt = gso.pkt;
+    pkt->frm = frm;
+    pkt->dat = frm->dat + 3 + cdn_hdr_size_pkt(pkt);
+    if (gso.frag) {
+        uint8_t *h = pkt->dat;
+        h[0] = gso.frag_port & 0xff;
+        h[1] = gso.frag_port >> 8;
+        h[2] = frag.id;
+        h[3] = gso.frag_off & 0xff;
+        h[4] = gso.frag_off >> 8;
+        h[5] = gso.frag_total & 0xff;
+        h[6] = gso.frag_total >> 8;
+        hdr = FRAG_HDR_SIZE;
+        gso.frag_off += n;
+        if (gso.left == n)
+            frag.id++;
+    }
+    pkt->len = hdr + n;
+    memcpy(pkt->dat + hdr, gso.dat, n);
+    gso.dat += n;
+    gso.left -= n;
+    *ip_len = IP_HDR_SIZE + n;
+    *cls = gso.cls;
+    *bus = gso.bus;
+
+    if (cdn_frame_w(pkt)) { // addition in: _s_mac, _d_mac
+        d_debug("-<-: to_frame error, drop\n");
+        stats_drop(DROP_TO_FRAME);
+        return -1;
+    }
+    STAT_ADD(stats.t2b_pkts, 1);
+    STAT_ADD(stats.t2b_bytes, *ip_len);
+    TRACE(TR_CONV, frm);
+    return 0;
+}
+
+// zero-copy version of cread + ip2frame:
+//   the udp payload is read straight into the frame, at the offset used by
+//   the previous packet, which is right for a steady flow; otherwise it is
+//   moved inside the frame once the real cdnet header size is known.
+// with tun_vnet_hdr, a udp gso super packet is split into several frames:
+//   the first segment is in place, the rest are copied out by later calls.
+// cls: output the tx class by tx_classify, FRAG_CLASS for fragments
+// bus: output the bus to send on
+// return 0: ok, -1: drop, -2: nothing to read
+int ip_read_frame(int fd, cdn_pkt_t *pkt, cd_frame_t *frm, int *ip_len, int *cls, int *bus)
+{
+    static int hdr_guess = 0; // only the tun reading thread calls this
+    struct virtio_net_hdr vh;
+    uint8_t ip_hdr[IP_HDR_SIZE];
+    uint8_t overflow[64];
+    bool big = tun_vnet_hdr || ip_frag; // the tun may hand over more than a frame
+    uint8_t *ovf = big ? gso.buf + CD_FRAME_SIZE : overflow;
+    int cap = CD_FRAME_SIZE - 3 - hdr_guess;
+    struct iovec iov[4] = {
+        { .iov_base = &vh, .iov_len = sizeof(vh) },
+        { .iov_base = ip_hdr, .iov_len = IP_HDR_SIZE },
+        { .iov_base = frm->dat + 3 + hdr_guess, .iov_len = cap },
+        { .iov_base = ovf, .iov_len = big ? GSO_BUF_SIZE : sizeof(overflow) }
+    };
+
+    if (gso.left) {
+        TRACE_LEN(TR_TUN_READ, frm, IP_HDR_SIZE + min(gso.left, gso.seg));
+        return gso_next(pkt, frm, ip_len, cls, bus);
+    }
+
+    if (tun_vnet_hdr) {
+        *ip_len = creadv(fd, iov, 4);
+        if (*ip_len <= 0)
+            return -2;
+        *ip_len -= sizeof(vh);
+    } else {
+        *ip_len = creadv(fd, iov + 1, 3);
+        if (*ip_len <= 0)
+            return -2;
+    }
+    TRACE_LEN(TR_TUN_READ, frm, *ip_len);
+
+    int total = *ip_len - IP_HDR_SIZE;
+    if (tun_vnet_hdr && vh.gso_type != VIRTIO_NET_HDR_GSO_NONE && total > 0) {
+        int seg = vh.gso_size;
+        if ((vh.gso_type & ~VIRTIO_NET_HDR_GSO_ECN) != VIRTIO_NET_HDR_GSO_UDP_L4 || !seg) {
+            d_warn("< ip: un-support gso type: %d, size: %d, skip...\n", vh.gso_type, seg);
+            stats_drop(DROP_GSO_TYPE);
+            return -1;
+        }
+        // parse as the first segment, the udp len of a super packet is meaningless
+        struct udp *udp = (struct udp *)(ip_hdr + 40);
+        udp->len = htons(min(seg, total) + 8);
+        *ip_len = IP_HDR_SIZE + min(seg, total);
+
+        // keep the rest segments before the first one is moved
+        if (total > seg) {
+            if (seg < cap) {
+                int in_frame = min(total, cap) - seg;
+                gso.dat = ovf - in_frame;
+                memcpy(gso.dat, frm->dat + 3 + hdr_guess + seg, in_frame);
+            } else {
+                gso.dat = ovf + (seg - cap);
+            }
+            gso.left = total - seg;
+            gso.seg = seg;
+            gso.frag = false;
+        }
+    }
+
+    pkt->frm = frm;
+    int ret = ip2cdnet_hdr(pkt, ip_hdr, *ip_len, bus); // also check the size against the real header
+    if (ret < 0 || (ret > 0 && gso.left)) {
+        if (ret > 0) {
+            d_warn("< ip: gso segment %d exceed frame size, skip...\n", pkt->len);
+            stats_drop(DROP_TOO_BIG);
+        }
+        d_debug("-<-: ip2cdnet drop\n");
+        gso.left = 0;
+        return -1;
+    }
+    struct ipv6 *ipv6 = (struct ipv6 *)ip_hdr;
+    struct udp *udp = (struct udp *)(ip_hdr + 40);
+    *cls = tx_classify(ipv6->traffic_class_hi << 4 | ipv6->traffic_class_lo, ntohs(udp->dst_port));
+
+    if (ret > 0) {
+        // fragment: the payload made contiguous in front of the overflow part
+        int in_frame = min(pkt->len, cap);
+        gso.dat = ovf - in_frame;
+        memmove(gso.dat, frm->dat + 3 + hdr_guess, in_frame);
+        gso.left = pkt->len;
+        gso.frag = true;
+        gso.frag_port = pkt->dst.port;
+        gso.frag_off = 0;
+        gso.frag_total = pkt->len;
+        pkt->dst.port = frag_port;
+        gso.seg = CD_FRAME_SIZE - 3 - cdn_hdr_size_pkt(pkt) - FRAG_HDR_SIZE - 2; // 2: crc
+        gso.pkt = *pkt;
+        gso.cls = FRAG_CLASS; // only this class takes the whole pool, see main
+        gso.bus = *bus;
+        STAT_ADD(stats.frag_tx, 1);
+        return gso_next(pkt, frm, ip_len, cls, bus);
+    }
+    if (gso.left) {
+        gso.pkt = *pkt;
+        gso.cls = *cls;
+        gso.bus = *bus;
+    }
+
+    int hdr_size = cdn_hdr_size_pkt(pkt);
+    pkt->dat = frm->dat + 3 + hdr_size;
+    if (hdr_size != hdr_guess) {
+        memmove(pkt->dat, frm->dat + 3 + hdr_guess, min(pkt->len, cap));
+        if (pkt->len > cap) // only if the guess was larger than the real header
+            memcpy(pkt->dat + cap, ovf, pkt->len - cap);
+        hdr_guess = hdr_size;
+    }
+
+    if (cdn_frame_w(pkt)) { // addition in: _s_mac, _d_mac
+        d_debug("-<-: to_frame error, drop\n");
+        stats_drop(DROP_TO_FRAME);
+        return -1;
+    }
+    STAT_ADD(stats.t2b_pkts, 1);
+    STAT_ADD(stats.t2b_bytes, *ip_len);
+    TRACE(TR_CONV, frm);
+    return 0;
+}
+
+// parse a frame received on bus, once for both paths, then the bus to bus
+// fast path: a unique local frame for a node on the net of another bus or
+// routed through another bus, goes straight to the tx_sched of that bus
+// instead of a round trip through the tun; both nets are in the header of a
+// unique local frame, so only the mac fields of the frame change.
+// pkt: the parsed frame, to hand to ip_write_frame if for the tun
+// cls: output the tx class by tx_classify, from the dst port
+// return the egress bus, -1: for the tun, -2: drop
+int ip_fwd_frame(cdn_pkt_t *pkt, cd_frame_t *frm, int bus, int *cls)
+{
+    pkt->frm = frm;
+    pkt->_l_net = bus_to_net(bus);
+    if (cdn_frame_r(pkt)) { // addition in: _l_net
+        d_debug("->-: from_frame error, drop\n");
+        stats_drop(DROP_FROM_FRAME);
+        return -2;
+    }
+    if (!bus_fwd || bus_num < 2 || pkt->dst.addr[0] != 0xa0)
+        return -1;
+    uint8_t mac = pkt->dst.addr[2];
+    int out = net_bus[pkt->dst.addr[1]];
+    if (out < 0 && route_lookup(pkt->dst.addr[1], &mac, &out) < 0)
+        return -1;
+    if (out == bus || mac == ipv6_self->s6_addr[15])
+        return -1; // back to the same bus, or our own address
+
+    frm->dat[0] = ipv6_self->s6_addr[15];
+    frm->dat[1] = mac;
+    *cls = tx_classify(0, pkt->dst.port);
+    STAT_ADD(stats.fwd_pkts, 1);
+    STAT_ADD(stats.fwd_bytes, frm->dat[2] + 3);
+    TRACE(TR_FWD, frm);
+    return out;
+}
+
+// zero-copy version of frame2ip + cwrite:
+//   the ip header is gathered in front of the payload which stays in the frame
+// with tun_vnet_hdr, only the pseudo-header sum is filled in and the kernel
+//   takes the packet as CHECKSUM_PARTIAL, so the payload is never summed
+// with ip_frag, the fragments are put together and written as one packet
+// pkt: frm parsed by ip_fwd_frame
+// bus: the bus the frame was received from
+// return 0: ok, -1: drop, 1: a fragment kept for later
+int ip_write_frame(int fd, cdn_pkt_t *pkt, cd_frame_t *frm, int *ip_len, int bus)
+{
+    struct virtio_net_hdr vh = {
+        .flags = VIRTIO_NET_HDR_F_NEEDS_CSUM,
+        .gso_type = VIRTIO_NET_HDR_GSO_NONE,
+        .csum_start = 40,
+        .csum_offset = offsetof(struct udp, check)
+    };
+    uint8_t ip_hdr[IP_HDR_SIZE];
+
+    if (ip_frag && pkt->dst.port == frag_port) {
+        int ret = frag_input(pkt, bus);
+        if (ret)
+            return ret;
+    }
+    cdnet2ip_hdr(pkt, ip_hdr, tun_vnet_hdr, bus);
+
+    struct iovec iov[3] = {
+        { .iov_base = &vh, .iov_len = sizeof(vh) },
+        { .iov_base = ip_hdr, .iov_len = IP_HDR_SIZE },
+        { .iov_base = pkt->dat, .iov_len = pkt->len }
+    };
+    *ip_len = IP_HDR_SIZE + pkt->len;
+    int nwrite = tun_vnet_hdr ? cwritev(fd, iov, 3) - (int)sizeof(vh) : cwritev(fd, iov + 1, 2);
+    d_debug(">>>: write to tun: %d/%d\n", nwrite, *ip_len);
+    if (nwrite != *ip_len) {
+        stats_drop(DROP_TUN_WRITE);
+        return -1;
+    }
+    STAT_ADD(stats.b2t_pkts, 1);
+    STAT_ADD(stats.b2t_bytes, nwrite);
+    TRACE(TR_TUN_WRITE, frm);
     return 0;
 }
@@ -26,11 +26,17 @@
 
 #include <assert.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 /* Add bytes in buffer to a running checksum. Returns the new
  * intermediate checksum. Use ip_checksum_fold() to convert the
  * intermediate checksum to final form.
  */
-static u64 ip_checksum_partial(const void *p, size_t len, u64 sum)
+static u64 ip_checksum_partial_c(const void *p, size_t len, u64 sum)
 {
 	/* Main loop: 32 bits at a time.
 	 * We take advantage of intel's ability to do unaligned memory
@@ -55,6 +61,106 @@ static u64 ip_checksum_partial(const void *p, size_t len, u64 sum)
 	return sum;
 }
 
+/* The vector versions below add the same 32-bit words into 64-bit lanes,
+ * so the intermediate sum is identical to the scalar one, and the trailing
+ * bytes are left to the scalar loop.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("sse2")))
+static u64 ip_checksum_partial_sse2(const void *p, size_t len, u64 sum)
+{
+	const u8 *p8 = p;
+	__m128i zero = _mm_setzero_si128();
+	__m128i acc0 = _mm_setzero_si128();
+	__m128i acc1 = _mm_setzero_si128();
+	u64 lanes[2];
+
+	for (; len >= 16; len -= 16, p8 += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)p8);
+		acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(v, zero));
+		acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(v, zero));
+	}
+	_mm_storeu_si128((__m128i *)lanes, _mm_add_epi64(acc0, acc1));
+	sum += lanes[0] + lanes[1];
+	return ip_checksum_partial_c(p8, len, sum);
+}
+
+__attribute__((target("avx2")))
+static u64 ip_checksum_partial_avx2(const void *p, size_t len, u64 sum)
+{
+	const u8 *p8 = p;
+	__m256i acc0 = _mm256_setzero_si256();
+	__m256i acc1 = _mm256_setzero_si256();
+	u64 lanes[4];
+
+	for (; len >= 32; len -= 32, p8 += 32) {
+		__m128i lo = _mm_loadu_si128((const __m128i *)p8);
+		__m128i hi = _mm_loadu_si128((const __m128i *)(p8 + 16));
+		acc0 = _mm256_add_epi64(acc0, _mm256_cvtepu32_epi64(lo));
+		acc1 = _mm256_add_epi64(acc1, _mm256_cvtepu32_epi64(hi));
+	}
+	_mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(acc0, acc1));
+	sum += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	return ip_checksum_partial_sse2(p8, len, sum);
+}
+
+#elif defined(__aarch64__)
+
+static u64 ip_checksum_partial_neon(const void *p, size_t len, u64 sum)
+{
+	const u8 *p8 = p;
+	uint64x2_t acc0 = vdupq_n_u64(0);
+	uint64x2_t acc1 = vdupq_n_u64(0);
+
+	for (; len >= 32; len -= 32, p8 += 32) {
+		acc0 = vpadalq_u32(acc0, vld1q_u32((const u32 *)p8));
+		acc1 = vpadalq_u32(acc1, vld1q_u32((const u32 *)(p8 + 16)));
+	}
+	sum += vaddvq_u64(vaddq_u64(acc0, acc1));
+	return ip_checksum_partial_c(p8, len, sum);
+}
+
+#endif
+
+/* Usable implementations, the scalar reference first. */
+static struct ip_checksum_impl impls[4] = {
+	{ "c", ip_checksum_partial_c }
+};
+static int impls_num = 1;
+
+const struct ip_checksum_impl *ip_checksum_impl = &impls[0];
+
+/* Pick the fastest implementation the CPU supports, at startup. */
+__attribute__((constructor))
+static void ip_checksum_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		impls[impls_num++] = (struct ip_checksum_impl)
+			{ "sse2", ip_checksum_partial_sse2 };
+	if (__builtin_cpu_supports("avx2"))
+		impls[impls_num++] = (struct ip_checksum_impl)
+			{ "avx2", ip_checksum_partial_avx2 };
+#elif defined(__aarch64__)
+	impls[impls_num++] = (struct ip_checksum_impl)
+		{ "neon", ip_checksum_partial_neon };
+#endif
+	ip_checksum_impl = &impls[impls_num - 1];
+}
+
+int ip_checksum_get_impls(const struct ip_checksum_impl **list)
+{
+	*list = impls;
+	return impls_num;
+}
+
+static inline u64 ip_checksum_partial(const void *p, size_t len, u64 sum)
+{
+	return ip_checksum_impl->partial(p, len, sum);
+}
+
 static __be16 ip_checksum_fold(u64 sum)
 {
 	while (sum & ~0xffffffffULL)
@@ -106,3 +212,50 @@ __be16 tcp_udp_v6_checksum(const struct in6_addr *src_ip,
 	sum = ip_checksum_partial(payload, len, sum);
 	return ip_checksum_fold(sum);
 }
+
+/* Same as tcp_udp_v6_checksum(), for a transport header and payload which
+ * are not contiguous in memory. hdr_len must be even.
+ */
+__be16 tcp_udp_v6_checksum2(const struct in6_addr *src_ip,
+			    const struct in6_addr *dst_ip,
+			    u8 protocol, const void *hdr, u32 hdr_len,
+			    const void *payload, u32 len)
+{
+	u64 sum = tcp_udp_v6_header_checksum_partial(
+		src_ip, dst_ip, protocol, hdr_len + len);
+	assert((hdr_len & 1) == 0);
+	sum = ip_checksum_partial(hdr, hdr_len, sum);
+	sum = ip_checksum_partial(payload, len, sum);
+	return ip_checksum_fold(sum);
+}
+
+/* Partial sum of the IPv6 pseudo-header with a zero length field, i.e. the
+ * part which is the same for all packets between two addresses.
+ */
+u64 tcp_udp_v6_pseudo_partial(const struct in6_addr *src_ip,
+			      const struct in6_addr *dst_ip, u8 protocol)
+{
+	return tcp_udp_v6_header_checksum_partial(src_ip, dst_ip, protocol, 0);
+}
+
+/* Finish a checksum from tcp_udp_v6_pseudo_partial(): the length is a
+ * separate 32-bit word of the pseudo-header, so it is simply added in.
+ * hdr_len must be even.
+ */
+__be16 tcp_udp_v6_checksum_cached(u64 pseudo_sum, const void *hdr, u32 hdr_len,
+				  const void *payload, u32 len)
+{
+	u64 sum = pseudo_sum + htonl(hdr_len + len);
+	assert((hdr_len & 1) == 0);
+	sum = ip_checksum_partial(hdr, hdr_len, sum);
+	sum = ip_checksum_partial(payload, len, sum);
+	return ip_checksum_fold(sum);
+}
+
+/* For checksum offload (CHECKSUM_PARTIAL): the folded pseudo-header sum,
+ * not inverted, for the checksum field. The kernel sums the rest.
+ */
+__sum16 tcp_udp_v6_pseudo_cached(u64 pseudo_sum, u32 len)
+{
+	return (__sum16)~ip_checksum_fold(pseudo_sum + htonl(len));
+}
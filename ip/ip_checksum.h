@@ -30,6 +30,20 @@
 #include <netinet/in.h>
 #include <sys/types.h>
 
+/* Implementations of the partial sum over a buffer, picked by the CPU
+ * features at startup. All of them return the same intermediate sum.
+ */
+struct ip_checksum_impl {
+	const char *name;
+	u64 (*partial)(const void *p, size_t len, u64 sum);
+};
+
+/* The implementation in use. */
+extern const struct ip_checksum_impl *ip_checksum_impl;
+
+/* All implementations usable on this CPU, the scalar reference first. */
+extern int ip_checksum_get_impls(const struct ip_checksum_impl **list);
+
 /* IPv6 ... */
 
 /* Calculates TCP, UDP, or ICMP checksum for IPv6 (in network byte order). */
@@ -37,4 +51,22 @@ extern __be16 tcp_udp_v6_checksum(const struct in6_addr *src_ip,
 				  const struct in6_addr *dst_ip,
 				  u8 protocol, const void *payload, u32 len);
 
+/* Same as above, for a header and payload which are not contiguous. */
+extern __be16 tcp_udp_v6_checksum2(const struct in6_addr *src_ip,
+				   const struct in6_addr *dst_ip,
+				   u8 protocol, const void *hdr, u32 hdr_len,
+				   const void *payload, u32 len);
+
+/* Partial sum of the pseudo-header with a zero length, to be cached per flow. */
+extern u64 tcp_udp_v6_pseudo_partial(const struct in6_addr *src_ip,
+				     const struct in6_addr *dst_ip, u8 protocol);
+
+/* Finish the checksum from a cached tcp_udp_v6_pseudo_partial() sum. */
+extern __be16 tcp_udp_v6_checksum_cached(u64 pseudo_sum, const void *hdr,
+					 u32 hdr_len, const void *payload,
+					 u32 len);
+
+/* The checksum field for CHECKSUM_PARTIAL, from a cached pseudo-header sum. */
+extern __sum16 tcp_udp_v6_pseudo_cached(u64 pseudo_sum, u32 len);
+
 #endif
@@ -18,6 +18,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <arpa/inet.h> 
@@ -25,6 +26,20 @@
 #include <sys/time.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include "tun.h"
+
+typedef struct {
+    struct nlmsghdr nh;
+    union {
+        struct ifinfomsg    ifi;
+        struct ifaddrmsg    ifa;
+        struct rtmsg        rt;
+    };
+    char attr[128];
+} nl_req_t;
 
 
 /**************************************************************************
@@ -61,15 +76,203 @@ int tun_alloc(char *dev, int flags)
     return fd;
 }
 
+/**************************************************************************
+ * tun_has_feature: check if the kernel supports a tun flag, e.g.        *
+ *                  IFF_VNET_HDR.                                         *
+ **************************************************************************/
+bool tun_has_feature(unsigned int flag)
+{
+    unsigned int features = 0;
+    int fd;
+
+    if ((fd = open("/dev/net/tun", O_RDWR)) < 0)
+        return false;
+    if (ioctl(fd, TUNGETFEATURES, &features) < 0)
+        features = 0;
+    close(fd);
+    return (features & flag) == flag;
+}
+
+/**************************************************************************
+ * tun_set_offload: set the vnet header size and enable checksum and udp *
+ *                  segmentation offload, fall back to checksum offload   *
+ *                  only if the kernel has no USO. Returns the offload    *
+ *                  flags set, or -1 on error.                            *
+ **************************************************************************/
+int tun_set_offload(int fd)
+{
+    int hdr_sz = sizeof(struct virtio_net_hdr);
+    unsigned int offload = TUN_F_CSUM | TUN_F_USO4 | TUN_F_USO6;
+
+    if (ioctl(fd, TUNSETVNETHDRSZ, &hdr_sz) < 0) {
+        perror("tun: ioctl(TUNSETVNETHDRSZ)");
+        return -1;
+    }
+    if (ioctl(fd, TUNSETOFFLOAD, offload) < 0) {
+        offload = TUN_F_CSUM; // USO needs linux 6.2
+        if (ioctl(fd, TUNSETOFFLOAD, offload) < 0) {
+            perror("tun: ioctl(TUNSETOFFLOAD)");
+            return -1;
+        }
+    }
+    return offload;
+}
+
+/**************************************************************************
+ * tun_set_nonblock: switch the fd to non-blocking mode.                  *
+ **************************************************************************/
+int tun_set_nonblock(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("tun: set O_NONBLOCK");
+        return -1;
+    }
+    return 0;
+}
+
+/**************************************************************************
+ * tun_nl_open: open a rtnetlink socket for the tun_nl_* calls.          *
+ **************************************************************************/
+int tun_nl_open(void)
+{
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+
+    if (fd < 0)
+        perror("tun: netlink socket");
+    return fd;
+}
+
+static void nl_attr(nl_req_t *req, int type, const void *dat, int len)
+{
+    struct rtattr *rta = (struct rtattr *)((char *)req + NLMSG_ALIGN(req->nh.nlmsg_len));
+
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH(len);
+    memcpy(RTA_DATA(rta), dat, len);
+    req->nh.nlmsg_len = NLMSG_ALIGN(req->nh.nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+// send the request and wait for its ack, return -1 with errno on error
+static int nl_talk(int nl, nl_req_t *req)
+{
+    static uint32_t seq = 0;
+    char buf[1024];
+
+    req->nh.nlmsg_flags |= NLM_F_REQUEST | NLM_F_ACK;
+    req->nh.nlmsg_seq = ++seq;
+    if (send(nl, req, req->nh.nlmsg_len, 0) < 0)
+        return -1;
+
+    while (true) {
+        int len = recv(nl, buf, sizeof(buf), 0);
+        if (len < 0)
+            return -1;
+        for (struct nlmsghdr *nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+            if (nh->nlmsg_seq != seq || nh->nlmsg_type != NLMSG_ERROR)
+                continue;
+            struct nlmsgerr *err = NLMSG_DATA(nh);
+            errno = -err->error;
+            return err->error ? -1 : 0;
+        }
+    }
+}
+
+static void nl_init(nl_req_t *req, int type, int flags, int len)
+{
+    memset(req, 0, sizeof(nl_req_t));
+    req->nh.nlmsg_len = NLMSG_LENGTH(len);
+    req->nh.nlmsg_type = type;
+    req->nh.nlmsg_flags = flags;
+}
+
+/**************************************************************************
+ * tun_nl_link: set the interface up, and the mtu and txqueuelen if > 0. *
+ **************************************************************************/
+int tun_nl_link(int nl, const char *dev, int mtu, int txqlen)
+{
+    nl_req_t req;
+    uint32_t val;
+
+    nl_init(&req, RTM_NEWLINK, 0, sizeof(struct ifinfomsg));
+    req.ifi.ifi_family = AF_UNSPEC;
+    req.ifi.ifi_index = if_nametoindex(dev);
+    req.ifi.ifi_flags = IFF_UP;
+    req.ifi.ifi_change = IFF_UP;
+    if (mtu > 0) {
+        val = mtu;
+        nl_attr(&req, IFLA_MTU, &val, 4);
+    }
+    if (txqlen > 0) {
+        val = txqlen;
+        nl_attr(&req, IFLA_TXQLEN, &val, 4);
+    }
+    if (!req.ifi.ifi_index || nl_talk(nl, &req) < 0) {
+        perror("tun: netlink set link");
+        return -1;
+    }
+    return 0;
+}
+
+/**************************************************************************
+ * tun_nl_addr: add or replace an ipv6 address, without dad, so it is    *
+ *              usable at once.                                           *
+ **************************************************************************/
+int tun_nl_addr(int nl, const char *dev, const struct in6_addr *addr, int plen)
+{
+    nl_req_t req;
+
+    nl_init(&req, RTM_NEWADDR, NLM_F_CREATE | NLM_F_REPLACE, sizeof(struct ifaddrmsg));
+    req.ifa.ifa_family = AF_INET6;
+    req.ifa.ifa_prefixlen = plen;
+    req.ifa.ifa_flags = IFA_F_NODAD;
+    req.ifa.ifa_index = if_nametoindex(dev);
+    nl_attr(&req, IFA_LOCAL, addr, 16);
+    nl_attr(&req, IFA_ADDRESS, addr, 16);
+    if (!req.ifa.ifa_index || nl_talk(nl, &req) < 0) {
+        perror("tun: netlink add address");
+        return -1;
+    }
+    return 0;
+}
+
+/**************************************************************************
+ * tun_nl_route: add or replace an ipv6 route to the interface.          *
+ **************************************************************************/
+int tun_nl_route(int nl, const char *dev, const struct in6_addr *dst, int plen)
+{
+    nl_req_t req;
+    uint32_t oif = if_nametoindex(dev);
+
+    nl_init(&req, RTM_NEWROUTE, NLM_F_CREATE | NLM_F_REPLACE, sizeof(struct rtmsg));
+    req.rt.rtm_family = AF_INET6;
+    req.rt.rtm_dst_len = plen;
+    req.rt.rtm_table = RT_TABLE_MAIN;
+    req.rt.rtm_protocol = RTPROT_BOOT;
+    req.rt.rtm_scope = RT_SCOPE_UNIVERSE;
+    req.rt.rtm_type = RTN_UNICAST;
+    if (plen)
+        nl_attr(&req, RTA_DST, dst, 16);
+    nl_attr(&req, RTA_OIF, &oif, 4);
+    if (!oif || nl_talk(nl, &req) < 0) {
+        perror("tun: netlink add route");
+        return -1;
+    }
+    return 0;
+}
+
 /**************************************************************************
  * cread: read routine that checks for errors and exits if an error is    *
- *        returned.                                                       *
+ *        returned. Returns -1 if a non-blocking fd has nothing to read.  *
  **************************************************************************/
 int cread(int fd, char *buf, int n)
 {
     int nread;
 
     if ((nread=read(fd, buf, n)) < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return -1;
         perror("tun: reading data");
         exit(1);
     }
@@ -78,13 +281,51 @@ int cread(int fd, char *buf, int n)
 
 /**************************************************************************
  * cwrite: write routine that checks for errors and exits if an error is  *
- *         returned.                                                      *
+ *         returned. Returns -1 if a non-blocking fd is not writable.     *
  **************************************************************************/
 int cwrite(int fd, char *buf, int n)
 {
     int nwrite;
 
     if ((nwrite=write(fd, buf, n)) < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return -1;
+        if (errno == EIO) // the tun is not up (yet), e.g. set up by ip after start
+            return -1;
+        perror("tun: writing data");
+        exit(1);
+    }
+    return nwrite;
+}
+
+/**************************************************************************
+ * creadv: scatter version of cread.                                      *
+ **************************************************************************/
+int creadv(int fd, const struct iovec *iov, int cnt)
+{
+    int nread;
+
+    if ((nread=readv(fd, iov, cnt)) < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return -1;
+        perror("tun: reading data");
+        exit(1);
+    }
+    return nread;
+}
+
+/**************************************************************************
+ * cwritev: gather version of cwrite.                                     *
+ **************************************************************************/
+int cwritev(int fd, const struct iovec *iov, int cnt)
+{
+    int nwrite;
+
+    if ((nwrite=writev(fd, iov, cnt)) < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return -1;
+        if (errno == EIO) // the tun is not up (yet), e.g. set up by ip after start
+            return -1;
         perror("tun: writing data");
         exit(1);
     }
@@ -100,7 +341,7 @@ int read_n(int fd, char *buf, int n)
     int nread, left = n;
 
     while (left > 0) {
-        if ((nread = cread(fd, buf, left)) == 0) {
+        if ((nread = cread(fd, buf, left)) <= 0) {
             return 0;
         } else {
             left -= nread;
@@ -21,6 +21,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <arpa/inet.h> 
@@ -28,7 +29,17 @@
 #include <sys/time.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <linux/virtio_net.h>
 
+// for older kernel headers
+#ifndef TUN_F_USO4
+#define TUN_F_USO4  0x20
+#define TUN_F_USO6  0x40
+#endif
+#ifndef VIRTIO_NET_HDR_GSO_UDP_L4
+#define VIRTIO_NET_HDR_GSO_UDP_L4   5
+#endif
 
 /* buffer for reading from tun/tap interface, must be >= 1500 */
 
@@ -38,18 +49,68 @@
  **************************************************************************/
 int tun_alloc(char *dev, int flags);
 
+/**************************************************************************
+ * tun_has_feature: check if the kernel supports a tun flag, e.g.        *
+ *                  IFF_VNET_HDR.                                         *
+ **************************************************************************/
+bool tun_has_feature(unsigned int flag);
+
+/**************************************************************************
+ * tun_set_offload: set the vnet header size and enable checksum and udp *
+ *                  segmentation offload, fall back to checksum offload   *
+ *                  only if the kernel has no USO. Returns the offload    *
+ *                  flags set, or -1 on error.                            *
+ **************************************************************************/
+int tun_set_offload(int fd);
+
+/**************************************************************************
+ * tun_set_nonblock: switch the fd to non-blocking mode.                  *
+ **************************************************************************/
+int tun_set_nonblock(int fd);
+
+/**************************************************************************
+ * tun_nl_open: open a rtnetlink socket for the tun_nl_* calls.          *
+ **************************************************************************/
+int tun_nl_open(void);
+
+/**************************************************************************
+ * tun_nl_link: set the interface up, and the mtu and txqueuelen if > 0. *
+ **************************************************************************/
+int tun_nl_link(int nl, const char *dev, int mtu, int txqlen);
+
+/**************************************************************************
+ * tun_nl_addr: add or replace an ipv6 address, without dad, so it is    *
+ *              usable at once.                                           *
+ **************************************************************************/
+int tun_nl_addr(int nl, const char *dev, const struct in6_addr *addr, int plen);
+
+/**************************************************************************
+ * tun_nl_route: add or replace an ipv6 route to the interface.          *
+ **************************************************************************/
+int tun_nl_route(int nl, const char *dev, const struct in6_addr *dst, int plen);
+
 /**************************************************************************
  * cread: read routine that checks for errors and exits if an error is    *
- *        returned.                                                       *
+ *        returned. Returns -1 if a non-blocking fd has nothing to read.  *
  **************************************************************************/
 int cread(int fd, char *buf, int n);
 
 /**************************************************************************
  * cwrite: write routine that checks for errors and exits if an error is  *
- *         returned.                                                      *
+ *         returned. Returns -1 if a non-blocking fd is not writable.     *
  **************************************************************************/
 int cwrite(int fd, char *buf, int n);
 
+/**************************************************************************
+ * creadv: scatter version of cread.                                      *
+ **************************************************************************/
+int creadv(int fd, const struct iovec *iov, int cnt);
+
+/**************************************************************************
+ * cwritev: gather version of cwrite.                                     *
+ **************************************************************************/
+int cwritev(int fd, const struct iovec *iov, int cnt);
+
 /**************************************************************************
  * read_n: ensures we read exactly n bytes, and puts them into "buf".     *
  *         (unless EOF, of course)                                        *
@@ -2,7 +2,6 @@
 
 if [ $UID -ne 0 ]; then echo "restart as root"; sudo "$0" "$@"; exit; fi
 cd "$(dirname "$0")"
-trap 'kill $(jobs -p)' EXIT
 
 
 # options may be followed by one colon to indicate they have a required argument
@@ -26,10 +25,9 @@ do
     shift
 done
 
-self6="fdcd::80:00" # 80:00:00
-self6_l0="fdcd::00" # 00:00:00
+self6="fdcd::80:00" # 80:00:00, the l0 address 00:00:00 is added too
 
-params="--self6=$self6"
+params="--self6=$self6 --tun-up"
 
 [ "$dev_type" == "" ] && dev_type="tty"
 params="$params --dev-type=$dev_type"
@@ -40,29 +38,6 @@ fi
 [ "$port_offset" != "" ] && params="$params --port-offset=$port_offset"
 [ "$tty_baud" != "" ] && params="$params --tty-baud=$tty_baud"
 
+# cdnet_tun brings tun0 up with the addresses itself, type ctrl-c to exit
 echo "invoke: ./cdnet_tun $params"
-./cdnet_tun $params &
-
-
-sleep 0.1
-echo "bring tun0 to up, and set ip to it"
-
-ip link set tun0 up
-rm_ip=$(ip -6 -br addr show dev tun0)
-IFS=' ' read -r -a array <<< "$rm_ip"
-rm_ip="${array[2]}"
-[ "$rm_ip" != "" ] && ip addr del "$rm_ip" dev tun0
-ip addr add "$self6/64" dev tun0
-ip addr add "$self6_l0/64" dev tun0
-
-if [ "$router6" != "" ]; then
-    echo "add default gw: $router6"
-    route add default gw "$router6"
-fi
-
-echo "set ip6 done:"
-ip -6 -br addr show dev tun0
-
-# type ctrl-c to exit
-sleep infinity
-
+exec ./cdnet_tun $params
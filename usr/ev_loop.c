@@ -0,0 +1,125 @@
+/*
+ * Software License Agreement (BSD License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <d@d-l.io>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "ev_loop.h"
+
+
+int ev_loop_init(ev_loop_t *loop)
+{
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0) {
+        perror("ev: epoll_create1");
+        return -1;
+    }
+    return 0;
+}
+
+int ev_add(ev_loop_t *loop, ev_src_t *src, uint32_t events)
+{
+    struct epoll_event ev = { .events = events, .data.ptr = src };
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, src->fd, &ev) < 0) {
+        perror("ev: epoll_ctl add");
+        return -1;
+    }
+    return 0;
+}
+
+int ev_mod(ev_loop_t *loop, ev_src_t *src, uint32_t events)
+{
+    struct epoll_event ev = { .events = events, .data.ptr = src };
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, src->fd, &ev) < 0) {
+        perror("ev: epoll_ctl mod");
+        return -1;
+    }
+    return 0;
+}
+
+int ev_del(ev_loop_t *loop, ev_src_t *src)
+{
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_DEL, src->fd, NULL) < 0) {
+        perror("ev: epoll_ctl del");
+        return -1;
+    }
+    return 0;
+}
+
+// return the number of callbacks invoked, 0 on timeout
+int ev_loop_once(ev_loop_t *loop, int timeout_ms)
+{
+    struct epoll_event evs[EV_BATCH];
+
+    int n = epoll_wait(loop->epfd, evs, EV_BATCH, timeout_ms);
+    if (n < 0) {
+        if (errno == EINTR)
+            return 0;
+        perror("ev: epoll_wait");
+        exit(1);
+    }
+
+    for (int i = 0; i < n; i++) {
+        ev_src_t *src = evs[i].data.ptr;
+        src->cb(src, evs[i].events);
+    }
+    return n;
+}
+
+
+int ev_eventfd_new(void)
+{
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0)
+        perror("ev: eventfd");
+    return fd;
+}
+
+void ev_eventfd_write(int fd)
+{
+    uint64_t val = 1;
+    if (write(fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+        perror("ev: eventfd write");
+}
+
+void ev_eventfd_read(int fd)
+{
+    uint64_t val;
+    if (read(fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+        perror("ev: eventfd read");
+}
+
+
+int ev_timerfd_new(void)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0)
+        perror("ev: timerfd_create");
+    return fd;
+}
+
+void ev_timerfd_set(int fd, uint32_t us)
+{
+    struct itimerspec its = {0};
+    its.it_value.tv_sec = us / 1000000;
+    its.it_value.tv_nsec = (us % 1000000) * 1000;
+    if (timerfd_settime(fd, 0, &its, NULL) < 0)
+        perror("ev: timerfd_settime");
+}
+
+void ev_timerfd_read(int fd)
+{
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        perror("ev: timerfd read");
+}
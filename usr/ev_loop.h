@@ -0,0 +1,66 @@
+/*
+ * Software License Agreement (BSD License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <d@d-l.io>
+ */
+
+/*
+ * ev_loop: a thin epoll wrapper
+ *
+ * example:
+ *
+ *  static void tun_cb(ev_src_t *src, uint32_t events)
+ *  {
+ *      int n = read(src->fd, buf, sizeof(buf));
+ *      ...
+ *  }
+ *
+ *  ev_loop_t loop;
+ *  ev_src_t tun_src = { .fd = tun_fd, .cb = tun_cb };
+ *  ev_loop_init(&loop);
+ *  ev_add(&loop, &tun_src, EPOLLIN);
+ *  while (true)
+ *      ev_loop_once(&loop, -1); // only return after some callbacks invoked
+ *
+ *  eventfd and timerfd helpers are used for the wakeups which are not
+ *  driven by an external fd, e.g. the deferred tx work of a device.
+ */
+
+#ifndef __EV_LOOP_H__
+#define __EV_LOOP_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/epoll.h>
+
+#define EV_BATCH    16  // max events returned by one epoll_wait
+
+typedef struct ev_src {
+    int     fd;
+    void    (* cb)(struct ev_src *src, uint32_t events);
+    void    *priv;
+} ev_src_t;
+
+typedef struct {
+    int     epfd;
+} ev_loop_t;
+
+
+int ev_loop_init(ev_loop_t *loop);
+int ev_add(ev_loop_t *loop, ev_src_t *src, uint32_t events);
+int ev_mod(ev_loop_t *loop, ev_src_t *src, uint32_t events);
+int ev_del(ev_loop_t *loop, ev_src_t *src);
+int ev_loop_once(ev_loop_t *loop, int timeout_ms);
+
+int ev_eventfd_new(void);
+void ev_eventfd_write(int fd);
+void ev_eventfd_read(int fd);
+
+int ev_timerfd_new(void);
+void ev_timerfd_set(int fd, uint32_t us); // one-shot, 0 for disarm
+void ev_timerfd_read(int fd);
+
+#endif
@@ -0,0 +1,137 @@
+/*
+ * Software License Agreement (BSD License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <d@d-l.io>
+ */
+
+#include <time.h>
+#include <sys/mman.h>
+#include "main.h"
+
+static const char *caller_name[POOL_CALLER_NUM] = { "tun", "dev_rx", "dev" };
+
+
+static uint32_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000U + ts.tv_nsec / 1000000;
+}
+
+// mem: "heap", "mlock": locked in ram, "huge": hugepage backed and locked
+int frame_pool_init(frame_pool_t *p, uint32_t size, uint32_t reserve, const char *mem)
+{
+    memset(p, 0, sizeof(*p));
+    if (!size || reserve >= size) {
+        d_error("frame_pool: wrong size: %u, reserve: %u\n", size, reserve);
+        return -1;
+    }
+    p->size = size;
+    p->reserve = reserve;
+    p->map_len = size * sizeof(cd_frame_t);
+
+    if (strcmp(mem, "heap") == 0) {
+        p->frames = calloc(size, sizeof(cd_frame_t));
+    } else if (strcmp(mem, "mlock") == 0 || strcmp(mem, "huge") == 0) {
+        void *m = MAP_FAILED;
+        if (strcmp(mem, "huge") == 0) {
+            size_t huge = 2 * 1024 * 1024;
+            size_t len = (p->map_len + huge - 1) / huge * huge;
+            m = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (m == MAP_FAILED)
+                d_warn("frame_pool: no hugepage, fall back to normal pages\n");
+            else
+                p->map_len = len;
+        }
+        if (m == MAP_FAILED)
+            m = mmap(NULL, p->map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (m == MAP_FAILED) {
+            perror("frame_pool: mmap");
+            return -1;
+        }
+        if (mlock(m, p->map_len) < 0)
+            perror("frame_pool: mlock"); // not fatal, e.g. RLIMIT_MEMLOCK
+        p->frames = m;
+    } else {
+        d_error("frame_pool: un-support mem: %s\n", mem);
+        return -1;
+    }
+
+    p->lease_t = calloc(size, sizeof(uint32_t));
+    p->lease_by = calloc(size, sizeof(uint8_t));
+    if (!p->frames || !p->lease_t || !p->lease_by) {
+        d_error("frame_pool: no memory\n");
+        return -1;
+    }
+
+    list_head_init(&p->free_head);
+    for (int i = 0; i < size; i++) {
+        list_put(&p->free_head, &p->frames[i].node);
+        p->lease_by[i] = POOL_DEV;
+    }
+    p->min_free = size;
+    d_info("frame_pool: size: %u, reserve: %u, mem: %s\n", size, reserve, mem);
+    return 0;
+}
+
+cd_frame_t *frame_pool_get(frame_pool_t *p, pool_caller_t by)
+{
+    if (frame_pool_low(p)) {
+        p->fail_cnt[by]++;
+        return NULL;
+    }
+    cd_frame_t *frm = list_get_entry(&p->free_head, cd_frame_t);
+    frame_pool_sample(p);
+    frame_pool_lease(p, frm, by);
+    return frm;
+}
+
+// a frame in free_head may be taken by the device at any time without a
+// lease, it is counted as held by the device from the time it was put back
+void frame_pool_put(frame_pool_t *p, cd_frame_t *frm)
+{
+    frame_pool_lease(p, frm, POOL_DEV);
+    list_put(&p->free_head, &frm->node);
+}
+
+void frame_pool_lease(frame_pool_t *p, cd_frame_t *frm, pool_caller_t by)
+{
+    int idx = frm - p->frames;
+    p->lease_t[idx] = now_ms();
+    p->lease_by[idx] = by;
+}
+
+// report usage, failures, and the frames held outside of free_head by the
+// last caller leased them, O(size), for diagnostics only
+void frame_pool_dump(frame_pool_t *p)
+{
+    list_node_t *pre, *pos;
+    uint32_t held[POOL_CALLER_NUM] = {0};
+    uint32_t oldest[POOL_CALLER_NUM] = {0};
+    uint32_t now = now_ms();
+    uint8_t *is_free = calloc(p->size, 1);
+    if (!is_free)
+        return;
+
+    list_for_each(&p->free_head, pre, pos)
+        is_free[list_entry(pos, cd_frame_t) - p->frames] = 1;
+
+    for (int i = 0; i < p->size; i++) {
+        if (is_free[i])
+            continue;
+        int by = p->lease_by[i];
+        held[by]++;
+        oldest[by] = max(oldest[by], now - p->lease_t[i]);
+    }
+    free(is_free);
+
+    d_info("frame_pool: free %u / %u, high-water in use %u, reserve %u\n",
+            p->free_head.len, p->size, p->size - p->min_free, p->reserve);
+    for (int i = 0; i < POOL_CALLER_NUM; i++)
+        d_info("frame_pool: %s: alloc fail %u, held %u, oldest %u ms\n",
+                caller_name[i], p->fail_cnt[i], held[i], oldest[i]);
+}
@@ -0,0 +1,65 @@
+/*
+ * Software License Agreement (BSD License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <d@d-l.io>
+ */
+
+/*
+ * frame_pool: the cd_frame_t pool shared by the gateway and the device
+ *
+ * The device backends take and return frames through free_head directly,
+ * all other users go through frame_pool_get / frame_pool_put, which keep the
+ * diagnostics. The pool is only touched by the thread servicing the device,
+ * other threads get their frames in batches through an spsc ring, which acts
+ * as their local cache (see gw_threads.c).
+ *
+ * reserve: frames kept for the device rx, frame_pool_get fails below it.
+ */
+
+#ifndef __FRAME_POOL_H__
+#define __FRAME_POOL_H__
+
+#include "cdbus.h"
+
+typedef enum {
+    POOL_TUN = 0,   // tun -> bus
+    POOL_DEV_RX,    // received by the device, leased when handed to us
+    POOL_DEV,       // handed to the device, or free and taken by it without a lease
+    POOL_CALLER_NUM
+} pool_caller_t;
+
+typedef struct {
+    cd_frame_t  *frames;
+    uint32_t    size;
+    uint32_t    reserve;
+    size_t      map_len;
+    list_head_t free_head;
+
+    uint32_t    min_free;       // low-water mark of free_head.len
+    uint32_t    fail_cnt[POOL_CALLER_NUM];
+    uint32_t    *lease_t;       // ms, the last time each frame was leased
+    uint8_t     *lease_by;      // pool_caller_t
+} frame_pool_t;
+
+
+int frame_pool_init(frame_pool_t *p, uint32_t size, uint32_t reserve, const char *mem);
+cd_frame_t *frame_pool_get(frame_pool_t *p, pool_caller_t by);
+void frame_pool_put(frame_pool_t *p, cd_frame_t *frm);
+void frame_pool_lease(frame_pool_t *p, cd_frame_t *frm, pool_caller_t by);
+void frame_pool_dump(frame_pool_t *p);
+
+static inline bool frame_pool_low(frame_pool_t *p)
+{
+    return p->free_head.len <= p->reserve;
+}
+
+static inline void frame_pool_sample(frame_pool_t *p)
+{
+    if (p->free_head.len < p->min_free)
+        p->min_free = p->free_head.len;
+}
+
+#endif
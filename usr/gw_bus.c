@@ -0,0 +1,121 @@
+/*
+ * Software License Agreement (BSD License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <d@d-l.io>
+ */
+
+#include "main.h"
+
+gw_bus_t gw_buses[GW_BUS_MAX];
+int gw_bus_num = 0;
+
+
+// "type=ld,dev=/dev/cdbus1,net=1", keys: type, dev, net, baud, gap, intn,
+// the fields not given are left as they are
+int gw_bus_cfg_parse(gw_bus_cfg_t *cfg, const char *str)
+{
+    char *s = strdup(str); // kept, cfg->type and cfg->dev point into it
+    char *save;
+
+    if (!s)
+        return -1;
+    for (char *kv = strtok_r(s, ",", &save); kv; kv = strtok_r(NULL, ",", &save)) {
+        char *val = strchr(kv, '=');
+        if (!val)
+            return -1;
+        *val++ = '\0';
+
+        if (strcmp(kv, "type") == 0) {
+            cfg->type = val;
+        } else if (strcmp(kv, "dev") == 0) {
+            cfg->dev = val;
+        } else if (strcmp(kv, "net") == 0) {
+            cfg->net = strtol(val, NULL, 0);
+            if (cfg->net < 0 || cfg->net > 255)
+                return -1;
+        } else if (strcmp(kv, "baud") == 0) {
+            cfg->baud = strtol(val, NULL, 0);
+        } else if (strcmp(kv, "gap") == 0) {
+            cfg->gap = strtol(val, NULL, 0);
+        } else if (strcmp(kv, "intn") == 0) {
+            cfg->intn = strtol(val, NULL, 0);
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static uint32_t gauge_list(void *arg)
+{
+    return ((list_head_t *)arg)->len;
+}
+
+// open the device of the next bus, exit on device errors
+// return NULL if the configuration is wrong
+gw_bus_t *gw_bus_open(const gw_bus_cfg_t *cfg, list_head_t *free_head,
+        const uint32_t *tx_depth, const bool *tx_drop_head, uint32_t dev_tx_depth)
+{
+    gw_bus_t *bus;
+    uint8_t net = cfg->net >= 0 ? cfg->net : ipv6_self->s6_addr[14];
+
+    if (gw_bus_num >= GW_BUS_MAX) {
+        d_error("bus: too many buses\n");
+        return NULL;
+    }
+    bus = &gw_buses[gw_bus_num];
+    memset(bus, 0, sizeof(gw_bus_t));
+    bus->id = gw_bus_num;
+    bus->net = net;
+    bus->dev_tx_depth = max(dev_tx_depth, 1);
+    uint8_t id = bus->id; // < GW_BUS_MAX, bounded for the name formats below
+    snprintf(bus->name, sizeof(bus->name), "bus%u", id);
+
+    if (ip_bus_add(bus->id, net) < 0) {
+        d_error("%s: net %d is served by another bus\n", bus->name, net);
+        return NULL;
+    }
+    if (tx_sched_init(&bus->tx_sched, free_head, tx_depth, tx_drop_head) < 0)
+        return NULL;
+
+    if (cfg->type && strcmp(cfg->type, "tty") == 0) {
+        bus->dev = cdbus_tty_wrapper_new(cfg->dev, free_head, cfg->baud, cfg->gap);
+#ifdef USE_SPI
+    } else if (cfg->type && strcmp(cfg->type, "spi") == 0) {
+        bus->dev = cdctl_spi_wrapper_new(cfg->dev, free_head, cfg->intn);
+#endif
+    } else if (cfg->type && strcmp(cfg->type, "ld") == 0) {
+        bus->dev = linux_dev_wrapper_new(cfg->dev, free_head);
+    } else {
+        d_error("%s: un-support dev_type: %s\n", bus->name, cfg->type);
+        return NULL;
+    }
+    bus->dev->lat = &bus->lat;
+    d_info("%s: net %d, type %s, our address: %02x:%02x:%02x\n", bus->name, net, cfg->type,
+            0x80, net, ipv6_self->s6_addr[15]);
+
+    snprintf(bus->gauge[0], sizeof(bus->gauge[0]), "bus%u_dev_rx", id);
+    snprintf(bus->gauge[1], sizeof(bus->gauge[1]), "bus%u_dev_tx", id);
+    for (int i = 0; i < TX_CLASS_NUM; i++)
+        snprintf(bus->gauge[2 + i], sizeof(bus->gauge[0]), "bus%u_tx_class%d", id, i);
+    stats_gauge_add(bus->gauge[0], gauge_list, bus->dev->rx_head);
+    stats_gauge_add(bus->gauge[1], gauge_list, bus->dev->tx_head);
+    for (int i = 0; i < TX_CLASS_NUM; i++)
+        stats_gauge_add(bus->gauge[2 + i], gauge_list, &bus->tx_sched.cls[i].head);
+
+    gw_bus_num++;
+    return bus;
+}
+
+// called by the thread owning the devices
+void gw_bus_dump(gw_bus_t *bus)
+{
+    d_info("%s: net %d, forwarded in %u, out %u\n", bus->name, bus->net, bus->fwd_in, bus->fwd_out);
+    tx_sched_dump(&bus->tx_sched);
+    lat_hist_dump(&bus->lat, "dev ready to service");
+    if (bus->dev->dump)
+        bus->dev->dump(bus->dev);
+}
@@ -0,0 +1,92 @@
+/*
+ * Software License Agreement (BSD License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <d@d-l.io>
+ */
+
+/*
+ * gw_bus: the cdbus adapters served by one cdnet_tun process
+ *
+ * Each bus is bound to its own net id and has its own device backend,
+ * tx_sched and device latency histogram. Outbound packets are steered by
+ * the net byte of the destination (ip_bus_add registers the map):
+ *   - the net of a bus: l1 local link on that bus
+ *   - other nets: unique local through the next hop and bus of the route, see route.h
+ *   - l0 and multicast: bus 0
+ *
+ * Our address on a bus is the --self6 prefix with the net of the bus:
+ * fdcd::80:<net><mac>, e.g. fdcd::80:0100 for net 1, mac 0. Each one is
+ * added to the tun as /120 (--tun-up does it), so the kernel picks it as the
+ * source address for the nodes of that net: replies are sent to the address
+ * of the bus they come from, the source address of outbound packets is not
+ * used.
+ *
+ * Unique local frames between the buses, also the routed ones, are forwarded
+ * in process by ip_fwd_frame, without the tun (--no-fwd: off).
+ *
+ * Bus 0 is set up by the legacy options (--dev-type, --dev, ...), its net
+ * is the one of --self6; the others by --bus1 .. --bus7, see gw_bus_cfg_parse.
+ */
+
+#ifndef __GW_BUS_H__
+#define __GW_BUS_H__
+
+#include "cdbus.h"
+#include "tx_sched.h"
+#include "lat_hist.h"
+
+#define GW_BUS_MAX      8
+
+// a device backend instance, see dev_wrapper/
+typedef struct dev_wrapper {
+    int         fd;     // run the task when readable, or writable if tx_wait
+    cd_dev_t    *cd_dev;
+    list_head_t *rx_head;
+    list_head_t *tx_head;
+    lat_hist_t  *lat;   // optional, event to service latency measured by the backend
+
+    void        (* task)(struct dev_wrapper *w);
+    bool        (* tx_wait)(struct dev_wrapper *w);    // optional, device waits for POLLOUT
+    bool        (* rx_wait)(struct dev_wrapper *w);    // optional, rx waits for free frames, not for POLLIN
+    bool        (* busy)(struct dev_wrapper *w);       // optional, task has work left without a new event
+    void        (* dump)(struct dev_wrapper *w);       // optional
+} dev_wrapper_t;
+
+typedef struct {
+    const char  *type;  // tty, spi, ld
+    const char  *dev;   // NULL: the default of the backend
+    int         net;    // -1: the net of --self6
+    uint32_t    baud;   // tty
+    uint32_t    gap;    // tty, 0: from the baudrate
+    int         intn;   // spi
+} gw_bus_cfg_t;
+
+typedef struct {
+    int             id;
+    char            name[8];    // bus0, bus1, ...
+    uint8_t         net;
+    dev_wrapper_t   *dev;
+    tx_sched_t      tx_sched;
+    uint32_t        dev_tx_depth;
+    lat_hist_t      lat;        // device ready (kick, retry timer, irq) to service
+    uint32_t        fwd_in;     // frames forwarded from this bus
+    uint32_t        fwd_out;    // frames forwarded to this bus, before tx_sched drops
+    char            gauge[5][20];
+} gw_bus_t;
+
+extern gw_bus_t gw_buses[GW_BUS_MAX];
+extern int gw_bus_num;
+
+int gw_bus_cfg_parse(gw_bus_cfg_t *cfg, const char *str);
+gw_bus_t *gw_bus_open(const gw_bus_cfg_t *cfg, list_head_t *free_head,
+        const uint32_t *tx_depth, const bool *tx_drop_head, uint32_t dev_tx_depth);
+void gw_bus_dump(gw_bus_t *bus);
+
+dev_wrapper_t *cdbus_tty_wrapper_new(const char *dev_name, list_head_t *free_head, uint32_t baudrate, uint32_t gap_us);
+dev_wrapper_t *cdctl_spi_wrapper_new(const char *dev_name, list_head_t *free_head, int intn);
+dev_wrapper_t *linux_dev_wrapper_new(const char *dev_name, list_head_t *free_head);
+
+#endif
@@ -0,0 +1,456 @@
+/*
+ * Software License Agreement (BSD License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <d@d-l.io>
+ */
+
+/*
+ * Threaded mode: one thread per direction, plus an optional device thread.
+ *
+ *   tun2bus:  tun read -> ip2frame -> tx_ring[bus][cls] -----> dev
+ *   dev:      free frames -> free_ring -----------------------> tun2bus
+ *             rx frames -> rx_ring[bus] ----------------------> bus2tun
+ *   bus2tun:  rx_ring -> frame2ip -> tun write -> done_ring --> dev
+ *
+ * Without --dev-thread, the devices are serviced by the bus2tun thread and
+ * rx_ring / done_ring are not used.
+ *
+ * The device backends and frame_pool are only touched by the thread
+ * servicing the devices, the other threads exchange frames with it through
+ * the spsc rings only. All the buses are serviced by that one thread: the
+ * frame pool stays single owner, each bus has its own rings, kick and
+ * retry timer, so a slow bus does not hold up the others.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include "main.h"
+#include "spsc_ring.h"
+
+typedef struct {
+    ev_src_t    src;    // eventfd
+    atomic_bool pending;
+    _Atomic uint64_t t;     // ns, the first kick since the last ack
+} kick_t;
+
+typedef struct {
+    gw_bus_t    *bus;
+    spsc_ring_t tx_ring[TX_CLASS_NUM]; // tun2bus -> dev: frames to send
+    spsc_ring_t rx_ring;    // dev -> bus2tun: received frames
+    spsc_ring_t done_ring;  // bus2tun -> dev: frames to be freed
+    kick_t      kick;       // wake dev: tx_ring or done_ring not empty
+    ev_src_t    dev_src;
+    ev_src_t    retry_src;
+    bool        dev_out;
+    bool        dev_rx_wait;    // dev_src does not watch EPOLLIN, rx waits for free frames
+    uint64_t    retry_due;
+    char        gauge[5][20];
+} mt_bus_t;
+
+static gw_threads_cfg_t cfg;
+
+static mt_bus_t mt_buses[GW_BUS_MAX];
+static spsc_ring_t free_ring;   // dev -> tun2bus: empty frames
+
+static ev_loop_t t2b_loop;
+static ev_loop_t dev_loop;
+static ev_loop_t b2t_loop;
+
+static kick_t free_kick;        // wake tun2bus: free_ring refilled
+static kick_t b2t_kick;         // wake bus2tun: a rx_ring not empty
+
+static ev_src_t t2b_tun_src;
+
+static atomic_bool t2b_starved;
+static bool t2b_paused = false;
+static cd_frame_t *t2b_spare = NULL; // keep the frame of a dropped packet
+
+static cdn_pkt_t t2b_packet = {0};
+static cdn_pkt_t fwd_packet = {0};
+static cdn_pkt_t *rx_pkts;      // --dev-thread: the parsed rx frames, by frame index
+
+
+static void kick(kick_t *k)
+{
+    if (!atomic_exchange(&k->pending, true)) {
+        atomic_store_explicit(&k->t, lat_now(), memory_order_relaxed);
+        ev_eventfd_write(k->src.fd);
+    }
+}
+
+static void kick_ack(kick_t *k)
+{
+    // clear first, a kick after this point always writes the eventfd again
+    atomic_store(&k->pending, false);
+    ev_eventfd_read(k->src.fd);
+}
+
+static void kick_init(kick_t *k, void (* cb)(ev_src_t *src, uint32_t events), void *priv)
+{
+    k->src.fd = ev_eventfd_new();
+    if (k->src.fd < 0)
+        exit(1);
+    k->src.cb = cb;
+    k->src.priv = priv;
+    atomic_init(&k->pending, false);
+    atomic_init(&k->t, 0);
+}
+
+static void thread_setup(const char *name, int cpu)
+{
+    pthread_setname_np(pthread_self(), name);
+    if (cpu < 0)
+        return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (ret)
+        d_warn("%s: pin to cpu %d failed: %s\n", name, cpu, strerror(ret));
+    else
+        d_info("%s: pinned to cpu %d\n", name, cpu);
+}
+
+
+static uint32_t gauge_ring(void *arg)
+{
+    return spsc_len(arg);
+}
+
+static void thread_rt(const char *name, int prio)
+{
+    if (prio <= 0)
+        return;
+
+    struct sched_param sp = { .sched_priority = prio };
+    int ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+    if (ret)
+        d_warn("%s: set SCHED_FIFO %d failed: %s\n", name, prio, strerror(ret));
+    else
+        d_info("%s: SCHED_FIFO %d\n", name, prio);
+}
+
+
+// tun2bus thread
+
+static void t2b_tun_cb(ev_src_t *src, uint32_t events)
+{
+    uint32_t queued = 0; // bit mask of the buses
+
+    for (int i = 0; i < cfg.tun_batch || ip_read_pending(); i++) {
+        cd_frame_t *frm = t2b_spare ? t2b_spare : spsc_get(&free_ring);
+        t2b_spare = NULL;
+
+        if (!frm) {
+            // stop watching tun until the dev thread hands over more frames
+            STAT_ADD(stats.tun_paused, 1);
+            t2b_paused = true;
+            ev_mod(&t2b_loop, src, 0);
+            atomic_store(&t2b_starved, true);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (spsc_len(&free_ring))
+                kick(&free_kick);
+            break;
+        }
+
+        int nread, cls, bus;
+        int ret = ip_read_frame(src->fd, &t2b_packet, frm, &nread, &cls, &bus);
+        if (ret == 0) {
+            d_debug("<<<: write to dev, tun len: %d, class: %d, bus: %d\n", nread, cls, bus);
+            spsc_put(&mt_buses[bus].tx_ring[cls], frm);
+            queued |= 1 << bus;
+        } else {
+            t2b_spare = frm;
+            if (ret == -2)
+                break; // drained
+        }
+    }
+
+    for (int i = 0; queued; i++, queued >>= 1) {
+        if (queued & 1)
+            kick(&mt_buses[i].kick);
+    }
+}
+
+static void t2b_free_cb(ev_src_t *src, uint32_t events)
+{
+    kick_ack(&free_kick);
+    if (t2b_paused) {
+        t2b_paused = false;
+        ev_mod(&t2b_loop, &t2b_tun_src, EPOLLIN);
+        if (ip_read_pending())
+            t2b_tun_cb(&t2b_tun_src, EPOLLIN);
+    }
+}
+
+static void *t2b_thread(void *arg)
+{
+    thread_setup("cdn-tun2bus", cfg.cpu_tun2bus);
+    while (true)
+        ev_loop_once(&t2b_loop, -1);
+    return NULL;
+}
+
+
+// bus2tun thread
+
+static void b2t_write(cdn_pkt_t *pkt, cd_frame_t *frm, int bus)
+{
+    int ip_len;
+    ip_write_frame(cfg.tun_fd, pkt, frm, &ip_len, bus);
+}
+
+static void b2t_rx_cb(ev_src_t *src, uint32_t events)
+{
+    kick_ack(&b2t_kick);
+    for (int i = 0; i < gw_bus_num; i++) {
+        mt_bus_t *b = &mt_buses[i];
+        cd_frame_t *frm;
+        bool done = false;
+
+        while ((frm = spsc_get(&b->rx_ring))) {
+            b2t_write(&rx_pkts[frm - frame_pool.frames], frm, i);
+            spsc_put(&b->done_ring, frm);
+            done = true;
+        }
+        if (done)
+            kick(&b->kick);
+    }
+}
+
+static void *b2t_thread(void *arg)
+{
+    thread_setup("cdn-bus2tun", cfg.cpu_bus2tun);
+    while (true)
+        ev_loop_once(&b2t_loop, -1);
+    return NULL;
+}
+
+
+// dev thread, or the bus2tun thread without --dev-thread
+
+// bus -> bus, the egress tx_sched is owned by this thread too,
+// frm parsed into fwd_packet,
+// return the egress bus, -1: for the tun, -2: drop
+static int dev_rx_fwd(gw_bus_t *bus, cd_frame_t *frm)
+{
+    int cls;
+    int out = ip_fwd_frame(&fwd_packet, frm, bus->id, &cls);
+    if (out < 0)
+        return out;
+    bus->fwd_in++;
+    gw_buses[out].fwd_out++;
+    if (tx_sched_put(&gw_buses[out].tx_sched, frm, cls) == 0)
+        kick(&mt_buses[out].kick);
+    return out;
+}
+
+static void dev_service_mt(mt_bus_t *b)
+{
+    gw_bus_t *bus = b->bus;
+    dev_wrapper_t *dev = bus->dev;
+    cd_frame_t *frm;
+    bool rx = false;
+
+    while ((frm = spsc_get(&b->done_ring)))
+        frame_pool_put(&frame_pool, frm);
+    for (int i = 0; i < TX_CLASS_NUM; i++) {
+        while ((frm = spsc_get(&b->tx_ring[i])))
+            tx_sched_put(&bus->tx_sched, frm, i);
+    }
+
+    tx_sched_feed(&bus->tx_sched, dev->cd_dev, dev->tx_head, bus->dev_tx_depth);
+    uint32_t tx_len = dev->tx_head->len;
+    dev->task(dev);
+    frame_pool_sample(&frame_pool);
+
+    while ((frm = dev->cd_dev->get_rx_frame(dev->cd_dev))) {
+        TRACE(TR_DEV_RX, frm);
+        int out = dev_rx_fwd(bus, frm);
+        if (out >= 0)
+            continue;
+        if (out == -1 && cfg.dev_thread) {
+            // the packet goes with the frame, published by the ring
+            rx_pkts[frm - frame_pool.frames] = fwd_packet;
+            frame_pool_lease(&frame_pool, frm, POOL_DEV_RX);
+            spsc_put(&b->rx_ring, frm);
+            rx = true;
+            continue;
+        }
+        if (out == -1)
+            b2t_write(&fwd_packet, frm, bus->id);
+        frame_pool_put(&frame_pool, frm);
+    }
+    if (rx)
+        kick(&b2t_kick);
+
+    // free_ring is the frame cache of the tun2bus thread
+    while (spsc_len(&free_ring) < cfg.frame_cache) {
+        if (!(frm = frame_pool_get(&frame_pool, POOL_TUN)))
+            break;
+        spsc_put(&free_ring, frm);
+    }
+    atomic_thread_fence(memory_order_seq_cst);
+    if (spsc_len(&free_ring) && atomic_exchange(&t2b_starved, false))
+        kick(&free_kick);
+
+    bool out = dev->tx_wait && dev->tx_wait(dev);
+    bool rx_wait = dev->rx_wait && dev->rx_wait(dev);
+    if (out != b->dev_out || rx_wait != b->dev_rx_wait) {
+        b->dev_out = out;
+        b->dev_rx_wait = rx_wait;
+        ev_mod(&dev_loop, &b->dev_src, (rx_wait ? 0 : EPOLLIN) | (out ? EPOLLOUT : 0));
+    }
+    for (int i = 0; i < gw_bus_num && frame_pool.free_head.len; i++) {
+        if (mt_buses[i].dev_rx_wait)
+            kick(&mt_buses[i].kick);
+    }
+
+    if (!b->dev_out && (dev->tx_head->len || tx_sched_len(&bus->tx_sched) || (dev->busy && dev->busy(dev)))) {
+        if (dev->tx_head->len < tx_len)
+            kick(&b->kick);
+        else {
+            b->retry_due = lat_now() + DEV_RETRY_US * 1000ULL;
+            ev_timerfd_set(b->retry_src.fd, DEV_RETRY_US);
+        }
+    }
+}
+
+static void dev_cb_mt(ev_src_t *src, uint32_t events)
+{
+    mt_bus_t *b = src->priv;
+
+    if (src == &b->kick.src) {
+        uint64_t t = atomic_load_explicit(&b->kick.t, memory_order_relaxed);
+        kick_ack(&b->kick);
+        lat_hist_add(&b->bus->lat, lat_now() - t);
+    } else if (src == &b->retry_src) {
+        ev_timerfd_read(b->retry_src.fd);
+        lat_hist_add(&b->bus->lat, lat_now() - b->retry_due);
+    }
+    dev_service_mt(b);
+}
+
+static void *dev_thread(void *arg)
+{
+    if (cfg.dev_thread) {
+        thread_setup("cdn-dev", cfg.cpu_dev);
+        thread_rt("cdn-dev", cfg.dev_prio);
+    } else
+        thread_setup("cdn-bus2tun", cfg.cpu_bus2tun);
+    for (int i = 0; i < gw_bus_num; i++)
+        dev_service_mt(&mt_buses[i]);
+    while (true) {
+        ev_loop_once(&dev_loop, -1);
+        if (dump_req) {
+            dump_req = 0;
+            gw_dump();
+        }
+        if (route_req) {
+            route_req = 0;
+            route_load(NULL);
+        }
+    }
+    return NULL;
+}
+
+
+void gw_threads_run(const gw_threads_cfg_t *_cfg)
+{
+    pthread_t t2b_id, b2t_id;
+    uint32_t ring_size = 1;
+    cfg = *_cfg;
+
+    // every frame of the pool may sit in one ring
+    while (ring_size < frame_pool.size)
+        ring_size <<= 1;
+    cfg.frame_cache = min(max(cfg.frame_cache, 1), frame_pool.size);
+
+    if (cfg.dev_thread)
+        rx_pkts = calloc(frame_pool.size, sizeof(cdn_pkt_t));
+    if (spsc_init(&free_ring, ring_size) || (cfg.dev_thread && !rx_pkts)) {
+        d_error("gw_threads: ring init failed\n");
+        exit(1);
+    }
+    atomic_init(&t2b_starved, false);
+
+    if (ev_loop_init(&t2b_loop) || ev_loop_init(&dev_loop) || ev_loop_init(&b2t_loop))
+        exit(1);
+
+    kick_init(&free_kick, t2b_free_cb, NULL);
+    kick_init(&b2t_kick, b2t_rx_cb, NULL);
+    t2b_tun_src.fd = cfg.tun_fd;
+    t2b_tun_src.cb = t2b_tun_cb;
+    if (ev_add(&t2b_loop, &t2b_tun_src, EPOLLIN) || ev_add(&t2b_loop, &free_kick.src, EPOLLIN) ||
+            ev_add(&b2t_loop, &b2t_kick.src, EPOLLIN))
+        exit(1);
+
+    for (int n = 0; n < gw_bus_num; n++) {
+        mt_bus_t *b = &mt_buses[n];
+        b->bus = &gw_buses[n];
+        for (int i = 0; i < TX_CLASS_NUM; i++) {
+            if (spsc_init(&b->tx_ring[i], ring_size)) {
+                d_error("gw_threads: ring init failed\n");
+                exit(1);
+            }
+        }
+        if (spsc_init(&b->rx_ring, ring_size) || spsc_init(&b->done_ring, ring_size)) {
+            d_error("gw_threads: ring init failed\n");
+            exit(1);
+        }
+        kick_init(&b->kick, dev_cb_mt, b);
+        b->dev_src.fd = b->bus->dev->fd;
+        b->dev_src.cb = dev_cb_mt;
+        b->dev_src.priv = b;
+        b->retry_src.fd = ev_timerfd_new();
+        b->retry_src.cb = dev_cb_mt;
+        b->retry_src.priv = b;
+        if (b->retry_src.fd < 0)
+            exit(1);
+        if (ev_add(&dev_loop, &b->dev_src, EPOLLIN) || ev_add(&dev_loop, &b->kick.src, EPOLLIN) ||
+                ev_add(&dev_loop, &b->retry_src, EPOLLIN))
+            exit(1);
+
+        for (int i = 0; i < TX_CLASS_NUM; i++) {
+            snprintf(b->gauge[i], sizeof(b->gauge[i]), "%s_ring_tx%d", b->bus->name, i);
+            stats_gauge_add(b->gauge[i], gauge_ring, &b->tx_ring[i]);
+        }
+        snprintf(b->gauge[3], sizeof(b->gauge[3]), "%s_ring_rx", b->bus->name);
+        snprintf(b->gauge[4], sizeof(b->gauge[4]), "%s_ring_done", b->bus->name);
+        stats_gauge_add(b->gauge[3], gauge_ring, &b->rx_ring);
+        stats_gauge_add(b->gauge[4], gauge_ring, &b->done_ring);
+    }
+    stats_gauge_add("ring_free", gauge_ring, &free_ring);
+
+    if (cfg.stats_src) {
+        cfg.stats_src->priv = &dev_loop;
+        if (ev_add(&dev_loop, cfg.stats_src, EPOLLIN))
+            exit(1);
+    }
+
+    // SIGUSR1 and SIGHUP are handled by the thread owning tx_sched only
+    sigset_t set, old;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+
+    d_info("gw_threads: start, buses: %d, dev_thread: %d, dev_prio: %d\n",
+            gw_bus_num, cfg.dev_thread, cfg.dev_prio);
+    if (pthread_create(&t2b_id, NULL, t2b_thread, NULL)) {
+        d_error("gw_threads: create tun2bus thread failed\n");
+        exit(1);
+    }
+    if (cfg.dev_thread && pthread_create(&b2t_id, NULL, b2t_thread, NULL)) {
+        d_error("gw_threads: create bus2tun thread failed\n");
+        exit(1);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    gw_ready(cfg.ready_fd, cfg.t_start);
+    dev_thread(NULL);
+}
@@ -0,0 +1,44 @@
+/*
+ * Software License Agreement (BSD License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <d@d-l.io>
+ */
+
+#include "main.h"
+
+
+// upper bound of the bucket
+static uint64_t idx_value(int idx)
+{
+    if (idx < LAT_HIST_SUB)
+        return idx;
+    int shift = (idx >> LAT_HIST_SUB_BITS) - 1;
+    uint64_t base = (uint64_t)(LAT_HIST_SUB + (idx & (LAT_HIST_SUB - 1))) << shift;
+    return base + ((1ULL << shift) - 1);
+}
+
+// value at the pct (0 ~ 100) percentile, never above max
+uint64_t lat_hist_pct(const lat_hist_t *h, double pct)
+{
+    uint64_t sum = 0;
+    if (!h->total)
+        return 0;
+    for (int i = 0; i < LAT_HIST_SIZE; i++) {
+        sum += h->cnt[i];
+        if (sum * 100.0 >= h->total * pct)
+            return min(idx_value(i), h->max);
+    }
+    return h->max;
+}
+
+void lat_hist_dump(const lat_hist_t *h, const char *name)
+{
+    d_info("%s: cnt %llu, p50 %llu, p90 %llu, p99 %llu, p99.9 %llu, p99.99 %llu, max %llu ns\n",
+            name, (unsigned long long)h->total,
+            (unsigned long long)lat_hist_pct(h, 50), (unsigned long long)lat_hist_pct(h, 90),
+            (unsigned long long)lat_hist_pct(h, 99), (unsigned long long)lat_hist_pct(h, 99.9),
+            (unsigned long long)lat_hist_pct(h, 99.99), (unsigned long long)h->max);
+}
@@ -0,0 +1,61 @@
+/*
+ * Software License Agreement (BSD License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <d@d-l.io>
+ */
+
+/*
+ * lat_hist: HDR style latency histogram in ns
+ *
+ * Log-linear buckets: each power of 2 is split into 2^LAT_HIST_SUB_BITS
+ * linear buckets, so a value is recorded within 1/16 of its size, over
+ * the full uint64_t range. Single writer, no locking.
+ */
+
+#ifndef __LAT_HIST_H__
+#define __LAT_HIST_H__
+
+#include <stdint.h>
+#include <time.h>
+
+#define LAT_HIST_SUB_BITS   4
+#define LAT_HIST_SUB        (1 << LAT_HIST_SUB_BITS)
+#define LAT_HIST_SIZE       ((64 - LAT_HIST_SUB_BITS + 1) * LAT_HIST_SUB)
+
+typedef struct {
+    uint64_t    cnt[LAT_HIST_SIZE];
+    uint64_t    total;
+    uint64_t    max;
+} lat_hist_t;
+
+
+static inline int lat_hist_idx(uint64_t v)
+{
+    if (v < LAT_HIST_SUB)
+        return v;
+    int shift = 63 - __builtin_clzll(v) - LAT_HIST_SUB_BITS;
+    return ((shift + 1) << LAT_HIST_SUB_BITS) + ((v >> shift) & (LAT_HIST_SUB - 1));
+}
+
+static inline uint64_t lat_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void lat_hist_add(lat_hist_t *h, uint64_t v)
+{
+    h->cnt[lat_hist_idx(v)]++;
+    h->total++;
+    if (v > h->max)
+        h->max = v;
+}
+
+uint64_t lat_hist_pct(const lat_hist_t *h, double pct);
+void lat_hist_dump(const lat_hist_t *h, const char *name);
+
+#endif
@@ -7,34 +7,304 @@
  * Author: Duke Fong <d@d-l.io>
  */
 
+#include <sys/un.h>
 #include "main.h"
 
-#define BUFSIZE 2000
-static uint8_t tmp_buf[BUFSIZE]; // for ip package
-
 static cdn_pkt_t tmp_packet = {0};
 
-static cd_frame_t frame_alloc[FRAME_MAX];
-list_head_t frame_free_head = {0};
+frame_pool_t frame_pool;
+
+// per bus state of the event loop
+typedef struct {
+    gw_bus_t    *bus;
+    ev_src_t    dev_src;
+    ev_src_t    kick_src;   // eventfd: deferred tx work for the device
+    ev_src_t    retry_src;  // timerfd: device made no tx progress, try later
+    bool        kicked;
+    uint64_t    kick_t;     // ns, for bus->lat
+    uint64_t    retry_due;
+    bool        dev_out;    // dev_src watches EPOLLOUT
+    bool        dev_rx_wait; // dev_src does not watch EPOLLIN, rx waits for free frames
+} bus_loop_t;
+
+static ev_loop_t ev_loop;
+static ev_src_t tun_src;
+static bus_loop_t bus_loops[GW_BUS_MAX];
+static bool tun_paused = false;
+static int tun_batch = TUN_BATCH_DEF;
+
+static ev_src_t stats_src;
+static const char *trace_file;
+volatile sig_atomic_t dump_req = 0; // SIGUSR1: dump the counters
+volatile sig_atomic_t route_req = 0; // SIGHUP: reload the route file
+
+
+static void tun_rx_cb(ev_src_t *src, uint32_t events);
+static void dev_kick(bus_loop_t *bl);
+
+
+// bus -> bus, frm parsed into tmp_packet,
+// return the egress bus, -1: for the tun, -2: drop
+static int dev_rx_fwd(gw_bus_t *bus, cd_frame_t *frm)
+{
+    int cls;
+    int out = ip_fwd_frame(&tmp_packet, frm, bus->id, &cls);
+    if (out < 0)
+        return out;
+    bus->fwd_in++;
+    gw_buses[out].fwd_out++;
+    if (tx_sched_put(&gw_buses[out].tx_sched, frm, cls) == 0)
+        dev_kick(&bus_loops[out]);
+    return out;
+}
+
+static void dev_kick(bus_loop_t *bl)
+{
+    if (!bl->kicked) {
+        bl->kicked = true;
+        bl->kick_t = lat_now();
+        ev_eventfd_write(bl->kick_src.fd);
+    }
+}
+
+// cdbus -> cdnet
+static void dev_rx_to_tun(gw_bus_t *bus)
+{
+    cd_dev_t *cd_dev = bus->dev->cd_dev;
+
+    while (true) {
+        cd_frame_t *frm = cd_dev->get_rx_frame(cd_dev);
+        if (!frm)
+            break;
+        TRACE(TR_DEV_RX, frm);
+        int out = dev_rx_fwd(bus, frm);
+        if (out >= 0)
+            continue;
+
+        if (out == -1) {
+            int ip_len;
+            ip_write_frame(tun_src.fd, &tmp_packet, frm, &ip_len, bus->id);
+        }
+        frame_pool_put(&frame_pool, frm);
+    }
+}
+
+// run the device task, then decide when it has to run again:
+//  - device waits for POLLOUT: nothing to do, dev_src wakes us
+//  - tx progress made: re-kick at once, e.g. linux_dev_wrapper sends one frame per call
+//  - no tx progress, or dev busy: the device is busy, retry by timer instead of spinning
+//  - rx out of frames: stop watching EPOLLIN, re-kick when frames are back
+static void dev_service(bus_loop_t *bl)
+{
+    gw_bus_t *bus = bl->bus;
+    dev_wrapper_t *dev = bus->dev;
+
+    tx_sched_feed(&bus->tx_sched, dev->cd_dev, dev->tx_head, bus->dev_tx_depth);
+    uint32_t tx_len = dev->tx_head->len;
+    dev->task(dev);
+    frame_pool_sample(&frame_pool);
+    dev_rx_to_tun(bus);
+
+    bool out = dev->tx_wait && dev->tx_wait(dev);
+    bool rx_wait = dev->rx_wait && dev->rx_wait(dev);
+    if (out != bl->dev_out || rx_wait != bl->dev_rx_wait) {
+        bl->dev_out = out;
+        bl->dev_rx_wait = rx_wait;
+        ev_mod(&ev_loop, &bl->dev_src, (rx_wait ? 0 : EPOLLIN) | (out ? EPOLLOUT : 0));
+    }
+
+    if (!bl->dev_out && (dev->tx_head->len || tx_sched_len(&bus->tx_sched) || (dev->busy && dev->busy(dev)))) {
+        if (dev->tx_head->len < tx_len)
+            dev_kick(bl);
+        else {
+            bl->retry_due = lat_now() + DEV_RETRY_US * 1000ULL;
+            ev_timerfd_set(bl->retry_src.fd, DEV_RETRY_US);
+        }
+    }
+
+    for (int i = 0; i < gw_bus_num && frame_pool.free_head.len; i++) {
+        if (bus_loops[i].dev_rx_wait)
+            dev_kick(&bus_loops[i]);
+    }
+    if (tun_paused && !frame_pool_low(&frame_pool)) {
+        tun_paused = false;
+        ev_mod(&ev_loop, &tun_src, EPOLLIN);
+        if (ip_read_pending())
+            tun_rx_cb(&tun_src, EPOLLIN);
+    }
+}
+
+static void dev_cb(ev_src_t *src, uint32_t events)
+{
+    bus_loop_t *bl = src->priv;
 
-cd_dev_t *cd_dev = NULL;
-list_head_t *cd_rx_head = NULL;
+    if (src == &bl->kick_src) {
+        ev_eventfd_read(bl->kick_src.fd);
+        bl->kicked = false;
+        lat_hist_add(&bl->bus->lat, lat_now() - bl->kick_t);
+    } else if (src == &bl->retry_src) {
+        ev_timerfd_read(bl->retry_src.fd);
+        lat_hist_add(&bl->bus->lat, lat_now() - bl->retry_due);
+    }
+    dev_service(bl);
+}
 
-static int dev_fd;
-static void (* dev_task)(void);
+// cdnet -> cdbus, drain up to tun_batch packets per wakeup
+static void tun_rx_cb(ev_src_t *src, uint32_t events)
+{
+    uint32_t queued = 0; // bit mask of the buses
 
-typedef enum {
-    DEV_TTY = 0,
-    DEV_SPI,
-    DEV_LD  // linux cdbus device
-} dev_type_t;
+    // the rest segments of a gso packet are not bound by tun_batch,
+    // the tun fd may not be readable again for them
+    for (int i = 0; i < tun_batch || ip_read_pending(); i++) {
+        cd_frame_t *frm = frame_pool_get(&frame_pool, POOL_TUN);
+        if (!frm) {
+            // stop watching tun until the device returns some frames
+            STAT_ADD(stats.tun_paused, 1);
+            tun_paused = true;
+            ev_mod(&ev_loop, &tun_src, 0);
+            break;
+        }
 
-static dev_type_t dev_type = DEV_TTY;
-static int intn_pin = -1;
+        int nread, cls, bus;
+        int ret = ip_read_frame(src->fd, &tmp_packet, frm, &nread, &cls, &bus);
+        if (ret == 0) {
+            d_debug("<<<: write to dev, tun len: %d, class: %d, bus: %d\n", nread, cls, bus);
+            if (tx_sched_put(&gw_buses[bus].tx_sched, frm, cls) == 0)
+                queued |= 1 << bus;
+        } else {
+            frame_pool_put(&frame_pool, frm);
+            if (ret == -2)
+                break; // drained
+        }
+    }
 
+    for (int i = 0; queued; i++, queued >>= 1) {
+        if (queued & 1)
+            dev_kick(&bus_loops[i]);
+    }
+}
+
+// SIGUSR1, called by the thread owning the devices
+void gw_dump(void)
+{
+    for (int i = 0; i < gw_bus_num; i++)
+        gw_bus_dump(&gw_buses[i]);
+    frame_pool_dump(&frame_pool);
+    if (trace_on)
+        trace_dump_file(trace_file);
+}
+
+static uint32_t gauge_list(void *arg)
+{
+    return ((list_head_t *)arg)->len;
+}
+
+static void sig_dump(int sig)
+{
+    dump_req = 1;
+}
+
+static void sig_route(int sig)
+{
+    route_req = 1;
+}
+
+// --router6 is the default route, the route file adds to or replaces it
+static void routes_init(const struct in6_addr *router6, const char *path)
+{
+    if (router6)
+        route_router6(router6);
+    if (path && route_load(path) < 0)
+        exit(-1);
+}
+
+// --tun-up: bring the tun up with our addresses on each bus, as /120, so the
+// kernel picks the one of the bus as the source (see gw_bus.h); route the
+// /64 of --self6 and the --tun-route prefixes ("fdcd:1::/64,::/0") to it
+static void tun_up(const char *dev, int mtu, int txqlen, const char *routes)
+{
+    struct in6_addr addr;
+    int nl = tun_nl_open();
+
+    if (nl < 0 || tun_nl_link(nl, dev, mtu, txqlen) < 0)
+        exit(1);
+    for (int i = 0; i < gw_bus_num; i++) {
+        addr = *ipv6_self;
+        addr.s6_addr[14] = gw_buses[i].net;
+        if (tun_nl_addr(nl, dev, &addr, 120) < 0)
+            exit(1);
+        addr.s6_addr[13] = 0; // l0 address
+        if (tun_nl_addr(nl, dev, &addr, 120) < 0)
+            exit(1);
+    }
+    addr = *ipv6_self;
+    memset(addr.s6_addr + 8, 0, 8);
+    if (tun_nl_route(nl, dev, &addr, 64) < 0)
+        exit(1);
+
+    while (routes && *routes) {
+        char str[64];
+        int n = strcspn(routes, ",");
+        snprintf(str, sizeof(str), "%.*s", n, routes);
+        routes += routes[n] ? n + 1 : n;
+
+        char *plen = strchr(str, '/');
+        if (plen)
+            *plen++ = '\0';
+        if (!plen || inet_pton(AF_INET6, str, addr.s6_addr) != 1 || atoi(plen) < 0 || atoi(plen) > 128) {
+            d_error("wrong tun-route: %s\n", str);
+            exit(-1);
+        }
+        if (tun_nl_route(nl, dev, &addr, atoi(plen)) < 0)
+            exit(1);
+    }
+    close(nl);
+    d_info("tun: %s up, mtu %d, txqueuelen %d\n", dev, mtu, txqlen);
+}
+
+// the devices and the tun are live: "READY=1" to $NOTIFY_SOCKET (systemd
+// Type=notify) and to --ready-fd, called once before serving the packets
+void gw_ready(int ready_fd, uint64_t t_start)
+{
+    const char *path = getenv("NOTIFY_SOCKET");
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    d_info("ready, %.1f ms after start\n", (lat_now() - t_start) / 1e6);
+    if (path && (path[0] == '/' || path[0] == '@') && strlen(path) < sizeof(addr.sun_path)) {
+        strcpy(addr.sun_path, path);
+        if (path[0] == '@') // abstract namespace
+            addr.sun_path[0] = '\0';
+        int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || sendto(fd, "READY=1", 7, 0, (struct sockaddr *)&addr,
+                offsetof(struct sockaddr_un, sun_path) + strlen(path)) < 0)
+            d_warn("notify: send to %s failed: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+    }
+    if (ready_fd >= 0) {
+        if (write(ready_fd, "READY=1\n", 8) != 8)
+            d_warn("notify: write to fd %d failed: %s\n", ready_fd, strerror(errno));
+        close(ready_fd);
+    }
+}
+
+// parse "a,b,c" into TX_CLASS_NUM numbers
+static int parse_class_list(const char *str, uint32_t *val)
+{
+    for (int i = 0; i < TX_CLASS_NUM; i++) {
+        char *end;
+        val[i] = strtol(str, &end, 0);
+        if (end == str || (i < TX_CLASS_NUM - 1 && *end != ','))
+            return -1;
+        str = end + 1;
+    }
+    return 0;
+}
 
 int main(int argc, char *argv[])
 {
+    uint64_t t_start = lat_now();
     int tun_fd;
     cd_args_t ca;
     cd_args_parse(&ca, argc, argv);
@@ -42,12 +312,55 @@ int main(int argc, char *argv[])
 
     const char *self6 = cd_arg_get(&ca, "--self6");
     const char *router6 = cd_arg_get(&ca, "--router6");
+    const char *routes_path = cd_arg_get(&ca, "--routes");
+    struct in6_addr router6_addr;
     const char *tun_str = cd_arg_get(&ca, "--tun");
-    const char *dev_name = cd_arg_get(&ca, "--dev");
-    const char *dev_tyte_str = cd_arg_get(&ca, "--dev-type");
-    const char *intn_str = cd_arg_get(&ca, "--intn");
-    uint32_t tty_baud = strtol(cd_arg_get_def(&ca, "--tty-baud", "115200"), NULL, 0);
+    bool tun_setup = cd_arg_get(&ca, "--tun-up") != NULL;
+    int tun_mtu = strtol(cd_arg_get_def(&ca, "--tun-mtu", "0"), NULL, 0);
+    int tun_txqlen = strtol(cd_arg_get_def(&ca, "--tun-txqlen", "0"), NULL, 0);
+    const char *tun_routes = cd_arg_get(&ca, "--tun-route");
+    int ready_fd = strtol(cd_arg_get_def(&ca, "--ready-fd", "-1"), NULL, 0);
+    gw_bus_cfg_t bus_cfg[GW_BUS_MAX] = {
+        {
+            .type = cd_arg_get(&ca, "--dev-type"),
+            .dev = cd_arg_get(&ca, "--dev"),
+            .net = -1,
+            .baud = strtol(cd_arg_get_def(&ca, "--tty-baud", "115200"), NULL, 0),
+            .gap = strtol(cd_arg_get_def(&ca, "--tty-gap", "0"), NULL, 0),
+            .intn = strtol(cd_arg_get_def(&ca, "--intn", "-1"), NULL, 0)
+        }
+    };
+    int bus_num = 1;
     port_offset = strtol(cd_arg_get_def(&ca, "--port-offset", "0"), NULL, 0);
+    tun_batch = strtol(cd_arg_get_def(&ca, "--tun-batch", "32"), NULL, 0);
+    bool tun_offload = cd_arg_get(&ca, "--tun-offload") != NULL;
+    bus_fwd = cd_arg_get(&ca, "--no-fwd") == NULL;
+    bool frag_on = cd_arg_get(&ca, "--frag") != NULL;
+    frag_port = strtol(cd_arg_get_def(&ca, "--frag-port", "0xfe"), NULL, 0);
+    int frag_max = strtol(cd_arg_get_def(&ca, "--frag-max", "16384"), NULL, 0);
+    int frag_timeout = strtol(cd_arg_get_def(&ca, "--frag-timeout", "500"), NULL, 0);
+    const char *tx_depth_str = cd_arg_get_def(&ca, "--tx-depth", "16,96,64");
+    const char *tx_drop_str = cd_arg_get_def(&ca, "--tx-drop", "tail,tail,tail");
+    const char *tx_port_rule_str = cd_arg_get(&ca, "--tx-port-rule");
+    uint32_t dev_tx_depth = strtol(cd_arg_get_def(&ca, "--dev-tx-depth", "2"), NULL, 0);
+    uint32_t frame_num = strtol(cd_arg_get_def(&ca, "--frames", "200"), NULL, 0);
+    uint32_t frame_reserve = strtol(cd_arg_get_def(&ca, "--frame-reserve", "5"), NULL, 0);
+    const char *frame_mem = cd_arg_get_def(&ca, "--frame-mem", "heap");
+    const char *stats_path = cd_arg_get(&ca, "--stats-sock");
+    trace_on = cd_arg_get(&ca, "--trace") != NULL;
+    trace_file = cd_arg_get_def(&ca, "--trace-file", "cdnet_tun.trace");
+    bool threads = cd_arg_get(&ca, "--threads") != NULL;
+    bool lock_all = cd_arg_get(&ca, "--mlockall") != NULL;
+    const char *replay_path = cd_arg_get(&ca, "--replay");
+    int replay_loops = strtol(cd_arg_get_def(&ca, "--replay-loops", "1"), NULL, 0);
+    gw_threads_cfg_t mt_cfg = {
+        .dev_thread = cd_arg_get(&ca, "--dev-thread") != NULL,
+        .dev_prio = strtol(cd_arg_get_def(&ca, "--dev-prio", "0"), NULL, 0),
+        .frame_cache = strtol(cd_arg_get_def(&ca, "--frame-cache", "32"), NULL, 0),
+        .cpu_tun2bus = strtol(cd_arg_get_def(&ca, "--cpu-tun2bus", "-1"), NULL, 0),
+        .cpu_bus2tun = strtol(cd_arg_get_def(&ca, "--cpu-bus2tun", "-1"), NULL, 0),
+        .cpu_dev = strtol(cd_arg_get_def(&ca, "--cpu-dev", "-1"), NULL, 0)
+    };
 
     if (self6 != NULL) {
         if (inet_pton(AF_INET6, self6, ipv6_self->s6_addr) != 1) {
@@ -61,141 +374,187 @@ int main(int argc, char *argv[])
     }
 
     if (router6 != NULL) {
-        if (inet_pton(AF_INET6, router6, default_router6->s6_addr) != 1) {
+        if (inet_pton(AF_INET6, router6, router6_addr.s6_addr) != 1) {
             d_debug("set router6 error: %s\n", router6);
             return -1;
         }
         d_debug("set router6: %s\n", router6);
-        has_router6 = true;
     }
 
-    if (dev_tyte_str && strcmp(dev_tyte_str, "tty") == 0) {
-        dev_type = DEV_TTY;
-#ifdef USE_SPI
-    } else if (dev_tyte_str && strcmp(dev_tyte_str, "spi") == 0) {
-        dev_type = DEV_SPI;
-#endif
-    } else if (dev_tyte_str && strcmp(dev_tyte_str, "ld") == 0) {
-        dev_type = DEV_LD;
-    } else {
-        d_error("un-support dev_type: %s\n", optarg);
-        exit(-1);
+    if (replay_path) { // offline, no tun or device
+        routes_init(router6 ? &router6_addr : NULL, routes_path);
+        return pcap_replay(replay_path, replay_loops) ? 1 : 0;
     }
 
-    if (intn_str != NULL) {
-        intn_pin = atol(intn_str);
-        d_debug("set intn_pin: %d\n", intn_pin);
+    // --bus1 .. --bus7, the tty options of bus 0 are the defaults
+    for (int i = 1; i < GW_BUS_MAX; i++) {
+        char opt[8];
+        snprintf(opt, sizeof(opt), "--bus%d", i);
+        const char *str = cd_arg_get(&ca, opt);
+        if (!str)
+            break;
+        bus_cfg[i] = bus_cfg[0];
+        bus_cfg[i].type = NULL;
+        bus_cfg[i].dev = NULL;
+        if (gw_bus_cfg_parse(&bus_cfg[i], str) < 0 || bus_cfg[i].net < 0) {
+            d_error("wrong %s: %s\n", opt, str);
+            exit(-1);
+        }
+        bus_num++;
+    }
+
+    // udp datagrams over several frames, the tun mtu follows unless set
+    if (frag_on) {
+        if (frag_max < CD_FRAME_SIZE || frag_max > 65535 - IP_HDR_SIZE || frag_timeout <= 0) {
+            d_error("wrong frag-max or frag-timeout: %d, %d\n", frag_max, frag_timeout);
+            exit(-1);
+        }
+        if (ip_frag_init(frag_max, frag_timeout) < 0)
+            exit(1);
+        if (!tun_mtu)
+            tun_mtu = max(IP_HDR_SIZE + frag_max, 1280);
+        if (!tun_setup)
+            d_info("frag: set the tun mtu to %d\n", tun_mtu);
     }
 
     // initialize tun interface
+    if (tun_mtu && tun_mtu < 1280) {
+        d_error("tun: ipv6 needs an mtu >= 1280\n");
+        exit(-1);
+    }
     if (tun_str)
-        strncpy(tun_name, tun_str, sizeof(tun_name));
-    if ((tun_fd = tun_alloc(tun_name, IFF_TUN | IFF_NO_PI)) < 0) {
+        snprintf(tun_name, sizeof(tun_name), "%s", tun_str);
+    int tun_flags = IFF_TUN | IFF_NO_PI;
+    if (tun_offload) {
+        if (tun_has_feature(IFF_VNET_HDR)) {
+            tun_flags |= IFF_VNET_HDR;
+            tun_vnet_hdr = true;
+        } else {
+            d_warn("tun: kernel without IFF_VNET_HDR, offload disabled\n");
+        }
+    }
+    if ((tun_fd = tun_alloc(tun_name, tun_flags)) < 0) {
         d_error("error connecting to tun interface: %s!\n", tun_name);
         exit(1);
     }
+    if (tun_vnet_hdr) {
+        int offload = tun_set_offload(tun_fd);
+        if (offload < 0)
+            d_warn("tun: set offload failed, keep vnet header only\n");
+        else
+            d_info("tun: offload: csum%s\n", (offload & TUN_F_USO6) ? ", uso" : "");
+    }
+    if (tun_set_nonblock(tun_fd) < 0)
+        exit(1);
+    if (tun_batch < 1)
+        tun_batch = 1;
+    d_debug("set tun_batch: %d\n", tun_batch);
 
-    for (int i = 0; i < FRAME_MAX; i++)
-        list_put(&frame_free_head, &frame_alloc[i].node);
+    // one pool shared by the buses, the destination of a tun packet is
+    // only known after it is read into a frame
+    if (frame_pool_init(&frame_pool, frame_num * bus_num, frame_reserve * bus_num, frame_mem) < 0)
+        exit(1);
 
-    if (dev_type == DEV_TTY) {
-        dev_fd = cdbus_tty_wrapper_init(dev_name, &frame_free_head, tty_baud);
-        dev_task = cdbus_tty_wrapper_task;
-#ifdef USE_SPI
-    } else if (dev_type == DEV_SPI) {
-        dev_fd = cdctl_spi_wrapper_init(dev_name, &frame_free_head, intn_pin);
-        dev_task = cdctl_spi_wrapper_task;
-#endif
-    } else if (dev_type == DEV_LD) {
-        dev_fd = linux_dev_wrapper_init(dev_name, &frame_free_head);
-        dev_task = linux_dev_wrapper_task;
+    uint32_t tx_depth[TX_CLASS_NUM];
+    bool tx_drop_head[TX_CLASS_NUM];
+    if (parse_class_list(tx_depth_str, tx_depth) < 0) {
+        d_error("wrong tx-depth: %s\n", tx_depth_str);
+        exit(-1);
     }
-    dev_task();
-    sleep(1);
-
-    while (true) {
-        int ret;
-        fd_set rd_set;
-        FD_ZERO(&rd_set);
-
-        if (cd_rx_head->len == 0) {
-            struct timeval tv = { .tv_sec = 0, .tv_usec = 1000 }; //us
-            FD_SET(tun_fd, &rd_set);
-            FD_SET(dev_fd, &rd_set);
-            ret = select(max(tun_fd, dev_fd) + 1, &rd_set, NULL, NULL, &tv);
-            if (ret < 0) {
-                if (errno == EINTR) {
-                    continue;
-                } else {
-                    perror("select()");
-                    exit(1);
-                }
-            }
-        } else {
-            d_verbose("skip select...\n");
+    if (ip_frag) {
+        // a fragment dropped wastes the whole datagram: let the fragment class take
+        // the whole pool, so the tun reads pause for free frames instead of dropping
+        tx_depth[FRAG_CLASS] = max(tx_depth[FRAG_CLASS], frame_num * bus_num);
+    }
+    for (int i = 0; i < TX_CLASS_NUM; i++) {
+        const char *p = tx_drop_str;
+        for (int n = 0; n < i && p; n++)
+            p = (p = strchr(p, ',')) ? p + 1 : NULL;
+        if (!p || (strncmp(p, "head", 4) && strncmp(p, "tail", 4))) {
+            d_error("wrong tx-drop: %s\n", tx_drop_str);
+            exit(-1);
         }
+        tx_drop_head[i] = strncmp(p, "head", 4) == 0;
+    }
+    if (tx_port_rules_parse(tx_port_rule_str) < 0) {
+        d_error("wrong tx-port-rule: %s\n", tx_port_rule_str);
+        exit(-1);
+    }
+    signal(SIGUSR1, sig_dump);
+    signal(SIGHUP, sig_route);
 
-        if (FD_ISSET(dev_fd, &rd_set) || cd_rx_head->len) {
-            dev_task(); // rx
-
-            while (true) {
-                // cdbus -> cdnet
-                cd_frame_t *frm = cd_dev->get_rx_frame(cd_dev);
-                if (!frm)
-                    break;
-
-                uint8_t frm_hdr = frm->dat[3];
-                tmp_packet.frm = frm;
-                tmp_packet._l_net = ipv6_self->s6_addr[14];
-
-                ret = cdn_frame_r(&tmp_packet); // addition in: _l_net
-                if (ret) {
-                    d_debug("->-: from_frame error, drop\n");
-                    list_put(&frame_free_head, &frm->node);
-                    continue;
-                }
-
-                int ip_len;
-                ret = cdnet2ip(&tmp_packet, tmp_buf, &ip_len);
-                list_put(&frame_free_head, &frm->node);
-                if (ret == 0) {
-                    int nwrite = cwrite(tun_fd, tmp_buf, ip_len);
-                    d_debug(">>>: write to tun: %d/%d\n", nwrite, ip_len);
-                    //hex_dump(tmp_buf, ip_len);
-                } else {
-                    d_debug("->-: cdnet2ip drop\n");
-                }
-            }
-        }
+    stats_gauge_add("free", gauge_list, &frame_pool.free_head);
+    for (int i = 0; i < bus_num; i++) {
+        if (!gw_bus_open(&bus_cfg[i], &frame_pool.free_head, tx_depth, tx_drop_head, dev_tx_depth))
+            exit(-1);
+    }
+    routes_init(router6 ? &router6_addr : NULL, routes_path); // the buses are known
+    if (tun_setup)
+        tun_up(tun_name, tun_mtu, tun_txqlen, tun_routes);
+    for (int i = 0; i < gw_bus_num; i++)
+        gw_buses[i].dev->task(gw_buses[i].dev);
 
-        if (FD_ISSET(tun_fd, &rd_set) && frame_free_head.len > 5) {
-            int nread = cread(tun_fd, tmp_buf, BUFSIZE);
-            if (nread != 0) {
-
-                cd_frame_t *frm = list_get_entry(&frame_free_head, cd_frame_t);
-                tmp_packet.frm = frm;
-                ret = ip2cdnet(&tmp_packet, tmp_buf, nread);
-                if (ret == 0) {
-                    d_debug("<<<: write to dev, tun len: %d\n", nread);
-                    //hex_dump(tmp_buf, nread);
-
-                    // cdnet -> cdbus
-                    ret = cdn_frame_w(&tmp_packet); // addition in: _s_mac, _d_mac
-
-                    if (ret == 0) {
-                        cd_dev->put_tx_frame(cd_dev, frm);
-                    } else {
-                        list_put(&frame_free_head, &frm->node);
-                        d_debug("-<-: to_frame error, drop\n");
-                    }
-                } else {
-                    list_put(&frame_free_head, &frm->node);
-                    d_debug("-<-: ip2cdnet drop\n");
-                }
-            }
-        }
+    if (stats_path) {
+        if (stats_sock_init(&stats_src, stats_path) < 0)
+            exit(1);
+        mt_cfg.stats_src = &stats_src;
+    }
+
+    // no page faults on the device path, including the thread stacks created later
+    if (lock_all) {
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+            d_warn("mlockall failed: %s\n", strerror(errno));
+        else
+            d_info("mlockall done\n");
+    }
+    if (mt_cfg.dev_prio > 0)
+        mt_cfg.dev_thread = true;
+
+    if (threads || mt_cfg.dev_thread) {
+        mt_cfg.tun_fd = tun_fd;
+        mt_cfg.tun_batch = tun_batch;
+        mt_cfg.ready_fd = ready_fd;
+        mt_cfg.t_start = t_start;
+        gw_threads_run(&mt_cfg); // never return
+    }
 
-        dev_task(); // tx
+    if (ev_loop_init(&ev_loop) < 0)
+        exit(1);
+    tun_src.fd = tun_fd;
+    tun_src.cb = tun_rx_cb;
+    if (ev_add(&ev_loop, &tun_src, EPOLLIN))
+        exit(1);
+    for (int i = 0; i < gw_bus_num; i++) {
+        bus_loop_t *bl = &bus_loops[i];
+        bl->bus = &gw_buses[i];
+        bl->kick_src.fd = ev_eventfd_new();
+        bl->retry_src.fd = ev_timerfd_new();
+        if (bl->kick_src.fd < 0 || bl->retry_src.fd < 0)
+            exit(1);
+        bl->dev_src.fd = bl->bus->dev->fd;
+        bl->dev_src.cb = bl->kick_src.cb = bl->retry_src.cb = dev_cb;
+        bl->dev_src.priv = bl->kick_src.priv = bl->retry_src.priv = bl;
+        if (ev_add(&ev_loop, &bl->dev_src, EPOLLIN) || ev_add(&ev_loop, &bl->kick_src, EPOLLIN) ||
+                ev_add(&ev_loop, &bl->retry_src, EPOLLIN))
+            exit(1);
+    }
+    stats_src.priv = &ev_loop;
+    if (stats_path && ev_add(&ev_loop, &stats_src, EPOLLIN))
+        exit(1);
+    for (int i = 0; i < gw_bus_num; i++)
+        dev_service(&bus_loops[i]); // flush frames received during the startup
+    gw_ready(ready_fd, t_start);
+
+    while (true) {
+        ev_loop_once(&ev_loop, -1);
+        if (dump_req) {
+            dump_req = 0;
+            gw_dump();
+        }
+        if (route_req) {
+            route_req = 0;
+            route_load(NULL);
+        }
     }
 
     return 0;
@@ -20,6 +20,7 @@
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <arpa/inet.h>
 #include <sys/select.h>
@@ -30,6 +31,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <getopt.h>
+#include <signal.h>
 
 #include "tun.h"
 #include "ip.h"
@@ -38,27 +40,67 @@
 #include "cdbus_uart.h"
 #include "cd_args.h"
 #include "cd_debug.h"
+#include "ev_loop.h"
+#include "tx_sched.h"
+#include "gw_bus.h"
+#include "route.h"
+#include "frame_pool.h"
+#include "lat_hist.h"
+#include "stats.h"
+#include "trace.h"
 
-#define FRAME_MAX   200
+#define IP_HDR_SIZE     48   // ipv6 + udp header
+#define GSO_BUF_SIZE    65536 // max udp gso super packet read from tun
+#define TUN_BATCH_DEF   32   // max packets read from tun per wakeup
+#define DEV_TX_DEPTH_DEF 2   // frames handed to the device ahead of tx_sched
+#define DEV_RETRY_US    1000 // retry interval if the device makes no tx progress
+#define FRAG_HDR_SIZE   7    // in front of each fragment, see ip_cdnet_conversion.c
+#define FRAG_SLOT_NUM   8    // datagrams put together at the same time
+#define FRAG_PORT_DEF   0xfe
+#define FRAG_CLASS      (TX_CLASS_NUM - 1) // all fragments on the bulk class, see ip_read_frame
 
-int cdctl_spi_wrapper_init(const char *dev_name, list_head_t *free_head, int intn);
-void cdctl_spi_wrapper_task(void);
+typedef struct {
+    int         tun_fd;     // the devices are the ones of gw_buses
+    int         tun_batch;
+    bool        dev_thread;     // service the devices on their own thread
+    int         dev_prio;       // SCHED_FIFO priority of the device thread, 0: not rt
+    ev_src_t    *stats_src;     // optional, served by the device thread
+    uint32_t    frame_cache;    // free frames handed to the tun2bus thread in advance
+    int         cpu_tun2bus;    // cpu affinity, -1: not pinned
+    int         cpu_bus2tun;
+    int         cpu_dev;
+    int         ready_fd;       // for gw_ready
+    uint64_t    t_start;
+} gw_threads_cfg_t;
 
-int cdbus_tty_wrapper_init(const char *dev_name, list_head_t *free_head, uint32_t baudrate);
-void cdbus_tty_wrapper_task(void);
-
-int linux_dev_wrapper_init(const char *dev_name, list_head_t *free_head);
-void linux_dev_wrapper_task(void);
+void gw_threads_run(const gw_threads_cfg_t *cfg);
+void gw_ready(int ready_fd, uint64_t t_start);
+void gw_dump(void);
 
 int ip2cdnet(cdn_pkt_t *pkt, const uint8_t *ip_dat, int ip_len);
 int cdnet2ip(cdn_pkt_t *pkt, uint8_t *ip_dat, int *ip_len);
+int ip2frame(cdn_pkt_t *pkt, cd_frame_t *frm, const uint8_t *ip_dat, int ip_len);
+int frame2ip(cdn_pkt_t *pkt, cd_frame_t *frm, uint8_t *ip_dat, int *ip_len);
+void flow_cache_flush(void);
+int pcap_replay(const char *path, int loops);
+bool ip_read_pending(void);
+int ip_read_frame(int fd, cdn_pkt_t *pkt, cd_frame_t *frm, int *ip_len, int *cls, int *bus);
+int ip_write_frame(int fd, cdn_pkt_t *pkt, cd_frame_t *frm, int *ip_len, int bus);
+int ip_bus_add(int bus, uint8_t net);
+int ip_bus_count(void);
+int ip_net_bus(uint8_t net);
+int ip_fwd_frame(cdn_pkt_t *pkt, cd_frame_t *frm, int bus, int *cls);
+int ip_frag_init(int max, int timeout_ms);
 
 extern struct in6_addr *ipv6_self;
-extern struct in6_addr *default_router6;
-extern bool has_router6;
 extern uint16_t port_offset;
+extern bool tun_vnet_hdr;
+extern bool bus_fwd;
+extern bool ip_frag;
+extern uint16_t frag_port;
 
-extern cd_dev_t *cd_dev;
-extern list_head_t *cd_rx_head;
+extern frame_pool_t frame_pool;
+extern volatile sig_atomic_t dump_req;
+extern volatile sig_atomic_t route_req;
 
 #endif
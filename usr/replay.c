@@ -0,0 +1,330 @@
+/*
+ * Software License Agreement (BSD License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <d@d-l.io>
+ */
+
+/*
+ * replay: push a capture of the tun traffic through the conversion, offline
+ *
+ * Each ipv6 packet of a pcap or pcapng file goes through ip2frame, then the
+ * frame is read back by cdn_frame_r as if the remote echoed it (addresses
+ * swapped) and converted by cdnet2ip. The result is compared with the
+ * original packet, with the addresses and ports swapped, the hop limit and
+ * the checksum as cdnet2ip sets them.
+ *
+ * Packets are converted in batches, the two directions are timed separately,
+ * the comparison is not timed. No tun or device is touched, --self6,
+ * --router6, --routes and --port-offset apply as usual; gso (--tun-offload)
+ * is not replayed.
+ *
+ * Link types: raw ip, ipv6, null / loopback, linux cooked v1 and v2.
+ */
+
+#include <byteswap.h>
+#include "main.h"
+#include "ip.h"
+#include "ip_checksum.h"
+
+#define REPLAY_BATCH    256
+#define REPLAY_IF_MAX   16  // pcapng interfaces
+
+typedef struct {
+    const uint8_t   *dat;   // ipv6 header
+    uint32_t        len;
+} rp_pkt_t;
+
+typedef enum {
+    MIS_IP_HDR = 0,
+    MIS_PORT,
+    MIS_LEN,
+    MIS_DATA,
+    MIS_CKSUM,
+    MIS_NUM
+} mismatch_t;
+
+static const char *mis_name[MIS_NUM] = { "ip_hdr", "port", "len", "data", "cksum" };
+
+static rp_pkt_t *pkts;
+static uint32_t pkt_num, pkt_max;
+static uint32_t skip_trunc, skip_link;
+static uint32_t mis_cnt[MIS_NUM];
+static uint32_t rt_ok;
+
+
+static uint32_t rd32(const uint8_t *p, bool swap)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return swap ? bswap_32(v) : v;
+}
+
+static uint16_t rd16(const uint8_t *p, bool swap)
+{
+    uint16_t v;
+    memcpy(&v, p, 2);
+    return swap ? bswap_16(v) : v;
+}
+
+// offset of the ip header for the link type, -1: not ipv6 or un-support
+static int link_hdr(uint32_t linktype, const uint8_t *d, uint32_t len)
+{
+    switch (linktype) {
+    case 12:  // DLT_RAW on most systems
+    case 14:  // DLT_RAW on some bsd
+    case 101: // LINKTYPE_RAW
+    case 229: // LINKTYPE_IPV6
+        return 0;
+    case 0:   // null / loopback, the family in host order of the capture host
+        if (len < 4)
+            return -1;
+        return (d[0] == 10 || d[0] == 24 || d[0] == 28 || d[0] == 30 ||
+                d[3] == 10 || d[3] == 24 || d[3] == 28 || d[3] == 30) ? 4 : -1;
+    case 113: // linux cooked v1
+        return (len >= 16 && d[14] == 0x86 && d[15] == 0xdd) ? 16 : -1;
+    case 276: // linux cooked v2
+        return (len >= 20 && d[0] == 0x86 && d[1] == 0xdd) ? 20 : -1;
+    }
+    return -1;
+}
+
+static void pkt_add(uint32_t linktype, const uint8_t *d, uint32_t cap_len, uint32_t orig_len)
+{
+    if (cap_len < orig_len) {
+        skip_trunc++;
+        return;
+    }
+    int ofs = link_hdr(linktype, d, cap_len);
+    if (ofs < 0) {
+        skip_link++;
+        return;
+    }
+    if (pkt_num == pkt_max) {
+        pkt_max = pkt_max ? pkt_max * 2 : 1024;
+        pkts = realloc(pkts, pkt_max * sizeof(rp_pkt_t));
+        if (!pkts) {
+            d_error("replay: no memory\n");
+            exit(-1);
+        }
+    }
+    pkts[pkt_num].dat = d + ofs;
+    pkts[pkt_num++].len = cap_len - ofs;
+}
+
+static int pcap_parse(const uint8_t *buf, size_t size)
+{
+    uint32_t magic = rd32(buf, false);
+    bool swap = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+    uint32_t linktype = rd32(buf + 20, swap) & 0xffff;
+    size_t pos = 24;
+
+    while (pos + 16 <= size) {
+        uint32_t cap_len = rd32(buf + pos + 8, swap);
+        uint32_t orig_len = rd32(buf + pos + 12, swap);
+        pos += 16;
+        if (cap_len > size - pos) {
+            d_warn("replay: pcap cut at %zu\n", pos);
+            break;
+        }
+        pkt_add(linktype, buf + pos, cap_len, orig_len);
+        pos += cap_len;
+    }
+    return 0;
+}
+
+static int pcapng_parse(const uint8_t *buf, size_t size)
+{
+    uint32_t linktype[REPLAY_IF_MAX];
+    uint32_t if_num = 0;
+    bool swap = false;
+    size_t pos = 0;
+
+    while (pos + 12 <= size) {
+        uint32_t type = rd32(buf + pos, swap);
+        if (type == 0x0a0d0d0a) { // section header, the byte order may change
+            swap = rd32(buf + pos + 8, false) == 0x4d3c2b1a;
+            if_num = 0;
+        }
+        uint32_t blen = rd32(buf + pos + 4, swap);
+        if (blen < 12 || blen % 4 || blen > size - pos) {
+            d_warn("replay: pcapng cut at %zu\n", pos);
+            break;
+        }
+        const uint8_t *b = buf + pos + 8; // block body
+
+        if (type == 1 && blen >= 20) { // interface description
+            if (if_num < REPLAY_IF_MAX)
+                linktype[if_num++] = rd16(b, swap);
+        } else if (type == 6 && blen >= 32) { // enhanced packet
+            uint32_t ifid = rd32(b, swap);
+            uint32_t cap_len = rd32(b + 12, swap);
+            uint32_t orig_len = rd32(b + 16, swap);
+            if (ifid < if_num && cap_len <= blen - 32)
+                pkt_add(linktype[ifid], b + 20, cap_len, orig_len);
+        } else if (type == 3 && blen >= 16 && if_num) { // simple packet
+            uint32_t orig_len = rd32(b, swap);
+            pkt_add(linktype[0], b + 4, min(orig_len, blen - 16), orig_len);
+        }
+        pos += blen;
+    }
+    return 0;
+}
+
+// the file is kept in memory, packets point into it
+static int replay_load(const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        d_error("replay: open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    long len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (len < 24) { // -1 on error, or too short for any header
+        d_error("replay: read %s failed\n", path);
+        fclose(fp);
+        return -1;
+    }
+    size_t size = (size_t)len;
+    uint8_t *buf = malloc(size);
+    if (!buf || fread(buf, 1, size, fp) != size) {
+        d_error("replay: read %s failed\n", path);
+        free(buf);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    uint32_t magic = rd32(buf, false);
+    if (magic == 0x0a0d0d0a)
+        return pcapng_parse(buf, size);
+    if (magic == 0xa1b2c3d4 || magic == 0xd4c3b2a1 || magic == 0xa1b23c4d || magic == 0x4d3cb2a1)
+        return pcap_parse(buf, size);
+    d_error("replay: %s: not pcap or pcapng\n", path);
+    free(buf);
+    return -1;
+}
+
+
+// what the original packet looks like after the echo, see the head comment
+static void expect_build(const uint8_t *ip, uint8_t *exp, int len)
+{
+    const struct ipv6 *in = (const struct ipv6 *)ip;
+    const struct udp *in_udp = (const struct udp *)(ip + 40);
+    struct ipv6 *ipv6 = (struct ipv6 *)exp;
+    struct udp *udp = (struct udp *)(exp + 40);
+
+    memset(exp, 0, IP_HDR_SIZE);
+    ipv6->version = 6;
+    ipv6->hop_limit = 255;
+    ipv6->next_header = IPPROTO_UDP;
+    ipv6->payload_len = in_udp->len;
+    ipv6->src_ip = in->dst_ip;
+    ipv6->dst_ip = in->src_ip;
+    udp->src_port = in_udp->dst_port;
+    udp->dst_port = in_udp->src_port;
+    udp->len = in_udp->len;
+    memcpy(exp + IP_HDR_SIZE, ip + IP_HDR_SIZE, len - IP_HDR_SIZE);
+    udp->check = tcp_udp_v6_checksum(&ipv6->src_ip, &ipv6->dst_ip, IPPROTO_UDP, udp, len - 40);
+}
+
+static void compare(const uint8_t *ip, const uint8_t *out, int out_len, uint32_t idx)
+{
+    uint8_t exp[IP_HDR_SIZE + CD_FRAME_SIZE];
+    const struct udp *in_udp = (const struct udp *)(ip + 40);
+    int len = IP_HDR_SIZE + ntohs(in_udp->len) - 8;
+    bool bad[MIS_NUM] = {0};
+
+    expect_build(ip, exp, len);
+    if (out_len != len) {
+        bad[MIS_LEN] = true;
+    } else {
+        bad[MIS_IP_HDR] = memcmp(exp, out, 40) != 0;
+        bad[MIS_PORT] = memcmp(exp + 40, out + 40, 4) != 0;
+        bad[MIS_CKSUM] = memcmp(exp + 46, out + 46, 2) != 0;
+        bad[MIS_DATA] = memcmp(exp + IP_HDR_SIZE, out + IP_HDR_SIZE, len - IP_HDR_SIZE) != 0;
+    }
+
+    bool any = false;
+    for (int i = 0; i < MIS_NUM; i++) {
+        if (bad[i]) {
+            mis_cnt[i]++;
+            if (mis_cnt[i] <= 3)
+                d_warn("replay: packet %u: %s mismatch\n", idx, mis_name[i]);
+            any = true;
+        }
+    }
+    if (!any)
+        rt_ok++;
+}
+
+int pcap_replay(const char *path, int loops)
+{
+    static cd_frame_t frames[REPLAY_BATCH];
+    static cdn_pkt_t tx[REPLAY_BATCH];
+    static uint8_t out[REPLAY_BATCH][IP_HDR_SIZE + CD_FRAME_SIZE];
+    static int out_len[REPLAY_BATCH];
+    static bool tx_ok[REPLAY_BATCH], rx_ok[REPLAY_BATCH];
+    uint64_t t2b_ns = 0, b2t_ns = 0, t2b_cnt = 0, b2t_cnt = 0;
+
+    if (replay_load(path))
+        return -1;
+    d_info("replay: %s: %u packets, skip: truncated %u, not ipv6 %u\n",
+            path, pkt_num, skip_trunc, skip_link);
+
+    for (int l = 0; l < loops; l++) {
+        for (uint32_t base = 0; base < pkt_num; base += REPLAY_BATCH) {
+            int n = min(REPLAY_BATCH, pkt_num - base);
+
+            uint64_t t = lat_now();
+            for (int i = 0; i < n; i++)
+                tx_ok[i] = ip2frame(&tx[i], &frames[i], pkts[base + i].dat, pkts[base + i].len) == 0;
+            t2b_ns += lat_now() - t;
+            t2b_cnt += n;
+
+            t = lat_now();
+            for (int i = 0; i < n; i++) {
+                cdn_pkt_t rx;
+                rx_ok[i] = false;
+                if (!tx_ok[i])
+                    continue;
+                rx.frm = &frames[i];
+                rx._l_net = ipv6_self->s6_addr[14];
+                if (cdn_frame_r(&rx)) {
+                    stats_drop(DROP_FROM_FRAME);
+                    continue;
+                }
+                cdn_sockaddr_t sa = rx.src;
+                rx.src = rx.dst;
+                rx.dst = sa;
+                rx_ok[i] = cdnet2ip(&rx, out[i], &out_len[i]) == 0;
+                b2t_cnt++;
+            }
+            b2t_ns += lat_now() - t;
+
+            if (l == 0) {
+                for (int i = 0; i < n; i++) {
+                    if (rx_ok[i])
+                        compare(pkts[base + i].dat, out[i], out_len[i], base + i);
+                }
+            }
+        }
+    }
+
+    d_info("replay: %d loops, tun->bus: %.0f pkt/s (%.1f ns/pkt), bus->tun: %.0f pkt/s (%.1f ns/pkt)\n",
+            loops, t2b_ns ? t2b_cnt * 1e9 / t2b_ns : 0, t2b_cnt ? (double)t2b_ns / t2b_cnt : 0,
+            b2t_ns ? b2t_cnt * 1e9 / b2t_ns : 0, b2t_cnt ? (double)b2t_ns / b2t_cnt : 0);
+    d_info("replay: round trip ok %u, mismatch: ip_hdr %u, port %u, len %u, data %u, cksum %u\n",
+            rt_ok, mis_cnt[MIS_IP_HDR], mis_cnt[MIS_PORT], mis_cnt[MIS_LEN],
+            mis_cnt[MIS_DATA], mis_cnt[MIS_CKSUM]);
+    for (int i = 0; i < DROP_NUM; i++) {
+        uint64_t v = atomic_load_explicit(&stats.drop[i], memory_order_relaxed);
+        if (v)
+            d_info("replay: drop %s: %llu\n", stats_drop_name(i), (unsigned long long)v);
+    }
+    return 0;
+}
@@ -0,0 +1,219 @@
+/*
+ * Software License Agreement (BSD License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <d@d-l.io>
+ */
+
+#include "main.h"
+
+route_t route_tbl[ROUTE_NUM];
+
+static char *route_path = NULL;  // the last file loaded
+static uint32_t router_ent = 0;  // --router6, the default route if the file has none
+
+#define FMT(...) do { \
+        if (len < size) \
+            len += snprintf(buf + len, size - len, __VA_ARGS__); \
+    } while (0)
+
+
+static int num_parse(const char *str, int max)
+{
+    char *end;
+    long val = strtol(str, &end, 0);
+    if (end == str || *end || val < 0 || val > max)
+        return -1;
+    return val;
+}
+
+// "default" or the net, return the table index, -1: wrong
+static int idx_parse(const char *str)
+{
+    if (strcmp(str, "default") == 0)
+        return ROUTE_DEFAULT;
+    return num_parse(str, 255);
+}
+
+// split by white space, return the number of tokens, max + 1 if more
+static int split(char *str, char **tok, int max)
+{
+    char *save;
+    int n = 0;
+    for (char *t = strtok_r(str, " \t\r\n", &save); t; t = strtok_r(NULL, " \t\r\n", &save)) {
+        if (n == max)
+            return max + 1;
+        tok[n++] = t;
+    }
+    return n;
+}
+
+// "<net|default> <mac> [bus]" in n tokens, return the entry, 0: wrong
+static uint32_t route_parse(char **tok, int n, int *idx)
+{
+    int mac, bus = 0;
+    if (n < 2 || n > 3)
+        return 0;
+    *idx = idx_parse(tok[0]);
+    mac = num_parse(tok[1], 255);
+    if (n > 2)
+        bus = num_parse(tok[2], ip_bus_count() - 1);
+    if (*idx < 0 || mac < 0 || bus < 0)
+        return 0;
+    return ROUTE_VALID | bus << 8 | mac;
+}
+
+
+// idx: net or ROUTE_DEFAULT, mac < 0: delete the route
+// called by one thread only, the one serving the stats socket after the startup
+int route_set(int idx, int mac, int bus)
+{
+    if (idx < 0 || idx >= ROUTE_NUM || mac > 255 || bus < 0 || bus >= ip_bus_count())
+        return -1;
+    uint32_t e = mac < 0 ? 0 : ROUTE_VALID | bus << 8 | mac;
+    atomic_store_explicit(&route_tbl[idx].ent, e, memory_order_relaxed);
+    flow_cache_flush();
+    return 0;
+}
+
+// --router6: the default route, through the bus serving the net of the router
+int route_router6(const struct in6_addr *addr)
+{
+    int bus = max(ip_net_bus(addr->s6_addr[14]), 0);
+    router_ent = ROUTE_VALID | bus << 8 | addr->s6_addr[15];
+    d_info("route: default: mac 0x%02x, bus %d\n", addr->s6_addr[15], bus);
+    atomic_store_explicit(&route_tbl[ROUTE_DEFAULT].ent, router_ent, memory_order_relaxed);
+    flow_cache_flush();
+    return 0;
+}
+
+// replace the table by the routes of the file, keep the table if the file is wrong
+// path: NULL: reload the last file
+int route_load(const char *path)
+{
+    uint32_t tbl[ROUTE_NUM] = {0};
+    char line[128];
+    int ln = 0, cnt = 0;
+
+    if (!path)
+        path = route_path;
+    if (!path) {
+        d_warn("route: no route file\n");
+        return -1;
+    }
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        d_error("route: open %s failed: %s\n", path, strerror(errno));
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        char *tok[4];
+        char *c = strchr(line, '#');
+        int idx, n;
+        ln++;
+        if (c)
+            *c = '\0';
+        if (!(n = split(line, tok, 3)))
+            continue;
+        uint32_t e = route_parse(tok, n, &idx);
+        if (!e) {
+            d_error("route: %s:%d: wrong route\n", path, ln);
+            fclose(fp);
+            return -1;
+        }
+        tbl[idx] = e;
+        cnt++;
+    }
+    fclose(fp);
+
+    if (!tbl[ROUTE_DEFAULT])
+        tbl[ROUTE_DEFAULT] = router_ent;
+    for (int i = 0; i < ROUTE_NUM; i++)
+        atomic_store_explicit(&route_tbl[i].ent, tbl[i], memory_order_relaxed);
+    flow_cache_flush();
+
+    if (path != route_path) {
+        free(route_path);
+        route_path = strdup(path);
+    }
+    d_info("route: %d routes loaded from %s\n", cnt, path);
+    return 0;
+}
+
+static int route_list(char *buf, int size)
+{
+    int len = 0;
+    FMT("net      mac   bus  packets\n");
+    for (int i = 0; i < ROUTE_NUM; i++) {
+        uint32_t e = atomic_load_explicit(&route_tbl[i].ent, memory_order_relaxed);
+        if (!e)
+            continue;
+        unsigned long long hits = atomic_load_explicit(&route_tbl[i].hits, memory_order_relaxed);
+        if (i == ROUTE_DEFAULT)
+            FMT("default  0x%02x  %-3u  %llu\n", e & 0xff, (e >> 8) & 0xff, hits);
+        else
+            FMT("%-7d  0x%02x  %-3u  %llu\n", i, e & 0xff, (e >> 8) & 0xff, hits);
+    }
+    FMT("miss: %llu\n", (unsigned long long)atomic_load_explicit(&stats.drop[DROP_NO_ROUTER],
+            memory_order_relaxed));
+    return min(len, size);
+}
+
+// a command of the stats socket, answer into buf, return the length
+int route_cmd(const char *cmd, char *buf, int size)
+{
+    char str[64];
+    char *tok[5];
+    int idx, n;
+    const char *err = NULL;
+
+    snprintf(str, sizeof(str), "%s", cmd);
+    n = split(str, tok, 5);
+
+    if (n == 1) {
+        // list only
+    } else if (n > 5) {
+        err = "too many arguments\n";
+    } else if (strcmp(tok[1], "add") == 0) {
+        uint32_t e = route_parse(tok + 2, n - 2, &idx);
+        if (!e)
+            err = "wrong route, usage: route add <net|default> <mac> [bus]\n";
+        else
+            route_set(idx, e & 0xff, (e >> 8) & 0xff);
+    } else if (strcmp(tok[1], "del") == 0) {
+        if (n != 3 || (idx = idx_parse(tok[2])) < 0)
+            err = "wrong route, usage: route del <net|default>\n";
+        else
+            route_set(idx, -1, 0);
+    } else if (strcmp(tok[1], "load") == 0 && n == 2) {
+        if (route_load(NULL) < 0)
+            err = "load failed, see the log\n";
+    } else {
+        err = "unknown command, try: route, route add, route del, route load\n";
+    }
+
+    if (err) {
+        snprintf(buf, size, "%s", err);
+        return strlen(buf);
+    }
+    return route_list(buf, size);
+}
+
+// the route counters in the prometheus text format, return the length
+int route_fmt(char *buf, int size)
+{
+    int len = 0;
+    FMT("# TYPE cdnet_route_packets_total counter\n");
+    for (int i = 0; i < ROUTE_NUM; i++) {
+        uint64_t hits = atomic_load_explicit(&route_tbl[i].hits, memory_order_relaxed);
+        if (!hits && !atomic_load_explicit(&route_tbl[i].ent, memory_order_relaxed))
+            continue;
+        if (i == ROUTE_DEFAULT)
+            FMT("cdnet_route_packets_total{net=\"default\"} %llu\n", (unsigned long long)hits);
+        else
+            FMT("cdnet_route_packets_total{net=\"%d\"} %llu\n", i, (unsigned long long)hits);
+    }
+    return min(len, size);
+}
@@ -0,0 +1,73 @@
+/*
+ * Software License Agreement (BSD License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <d@d-l.io>
+ */
+
+/*
+ * route: the next hop for the nets not served by our buses
+ *
+ * The table is indexed by the net byte of the destination, 256 entries and
+ * a default one: the entry of the net wins over the default, the lookup is
+ * at most two array reads. A net served by one of our buses is sent on that
+ * bus directly, its route entry is not used.
+ *
+ * Route file (--routes), one route per line, '#' starts a comment:
+ *   <net> <mac> [bus]      e.g. "5 0x01 1": net 5 through the router at mac 1 on bus1
+ *   default <mac> [bus]
+ * the bus defaults to 0. --router6 is the default route if the file has none.
+ *
+ * Runtime updates, by the thread serving the stats socket (see stats.h):
+ *   "route": list the table with the packet count of each route
+ *   "route add <net|default> <mac> [bus]", "route del <net|default>"
+ *   "route load": re-read the route file, also on SIGHUP
+ * each update flushes the flow cache.
+ *
+ * Route hits are the packets from the tun sent by each route, the misses are
+ * the drops with reason no_router. Frames forwarded between the buses
+ * (ip_fwd_frame) also follow the table, they are only counted as bus2bus.
+ */
+
+#ifndef __ROUTE_H__
+#define __ROUTE_H__
+
+#include <stdatomic.h>
+#include <netinet/in.h>
+
+#define ROUTE_DEFAULT   256         // index of the default route
+#define ROUTE_NUM       257
+#define ROUTE_VALID     0x10000     // entry: ROUTE_VALID | bus << 8 | mac
+
+typedef struct {
+    _Atomic uint32_t ent;   // 0: no route, written by one thread only
+    _Atomic uint64_t hits;  // bumped by the tun reading thread
+} route_t;
+
+extern route_t route_tbl[ROUTE_NUM];
+
+// return the index of the route used, -1: no route
+static inline int route_lookup(uint8_t net, uint8_t *mac, int *bus)
+{
+    int idx = net;
+    uint32_t e = atomic_load_explicit(&route_tbl[net].ent, memory_order_relaxed);
+    if (!e) {
+        idx = ROUTE_DEFAULT;
+        e = atomic_load_explicit(&route_tbl[ROUTE_DEFAULT].ent, memory_order_relaxed);
+        if (!e)
+            return -1;
+    }
+    *mac = e & 0xff;
+    *bus = (e >> 8) & 0xff;
+    return idx;
+}
+
+int route_set(int idx, int mac, int bus);
+int route_router6(const struct in6_addr *addr);
+int route_load(const char *path);
+int route_cmd(const char *cmd, char *buf, int size);
+int route_fmt(char *buf, int size);
+
+#endif
@@ -0,0 +1,77 @@
+/*
+ * Software License Agreement (BSD License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <d@d-l.io>
+ */
+
+/*
+ * spsc_ring: lock-free single-producer / single-consumer pointer ring
+ *
+ * Only one thread may call spsc_put, and only one other thread may call
+ * spsc_get. The size must be a power of 2.
+ *
+ * A ring sized >= the total number of frames never overflows, because each
+ * frame can only sit in one queue at a time.
+ */
+
+#ifndef __SPSC_RING_H__
+#define __SPSC_RING_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+typedef struct {
+    _Alignas(64) _Atomic uint32_t head; // written by producer
+    _Alignas(64) _Atomic uint32_t tail; // written by consumer
+    _Alignas(64) uint32_t mask;
+    void        **buf;
+} spsc_ring_t;
+
+
+static inline int spsc_init(spsc_ring_t *r, uint32_t size)
+{
+    if (!size || (size & (size - 1)))
+        return -1;
+    r->buf = calloc(size, sizeof(void *));
+    if (!r->buf)
+        return -1;
+    r->mask = size - 1;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    return 0;
+}
+
+static inline uint32_t spsc_len(spsc_ring_t *r)
+{
+    return atomic_load_explicit(&r->head, memory_order_acquire) -
+            atomic_load_explicit(&r->tail, memory_order_acquire);
+}
+
+static inline bool spsc_put(spsc_ring_t *r, void *p)
+{
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (head - tail > r->mask)
+        return false;
+    r->buf[head & r->mask] = p;
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+    return true;
+}
+
+static inline void *spsc_get(spsc_ring_t *r)
+{
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    if (head == tail)
+        return NULL;
+    void *p = r->buf[tail & r->mask];
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+    return p;
+}
+
+#endif
@@ -0,0 +1,214 @@
+/*
+ * Software License Agreement (BSD License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <d@d-l.io>
+ */
+
+#define _GNU_SOURCE
+#include <sys/un.h>
+#include "main.h"
+
+stats_t stats;
+
+static const char *drop_name[DROP_NUM] = {
+    "ip_short", "ip_version", "ip_unspec", "ip_mcast", "not_match", "no_route", "no_router",
+    "not_udp", "port_offset", "udp_len", "too_big", "gso_type", "to_frame", "tx_queue",
+    "from_frame", "tun_write", "frag"
+};
+
+static struct {
+    const char  *name;
+    uint32_t    (* get)(void *arg);
+    void        *arg;
+} gauges[STATS_GAUGE_MAX];
+static int gauge_num = 0;
+
+
+// register a queue depth gauge, get() is called by the thread serving the socket
+void stats_gauge_add(const char *name, uint32_t (* get)(void *arg), void *arg)
+{
+    if (gauge_num >= STATS_GAUGE_MAX) {
+        d_warn("stats: too many gauges, skip %s\n", name);
+        return;
+    }
+    gauges[gauge_num].name = name;
+    gauges[gauge_num].get = get;
+    gauges[gauge_num++].arg = arg;
+}
+
+const char *stats_drop_name(drop_reason_t r)
+{
+    return drop_name[r];
+}
+
+#define FMT(...) do { \
+        if (len < size) \
+            len += snprintf(buf + len, size - len, __VA_ARGS__); \
+    } while (0)
+
+static uint64_t rd(_Atomic uint64_t *c)
+{
+    return atomic_load_explicit(c, memory_order_relaxed);
+}
+
+// return the length, truncated at size
+int stats_fmt(char *buf, int size)
+{
+    int len = 0;
+
+    FMT("# TYPE cdnet_drop_total counter\n");
+    for (int i = 0; i < DROP_NUM; i++)
+        FMT("cdnet_drop_total{reason=\"%s\"} %llu\n", drop_name[i], (unsigned long long)rd(&stats.drop[i]));
+
+    FMT("# TYPE cdnet_packets_total counter\n");
+    FMT("cdnet_packets_total{dir=\"tun2bus\"} %llu\n", (unsigned long long)rd(&stats.t2b_pkts));
+    FMT("cdnet_packets_total{dir=\"bus2tun\"} %llu\n", (unsigned long long)rd(&stats.b2t_pkts));
+    FMT("cdnet_packets_total{dir=\"bus2bus\"} %llu\n", (unsigned long long)rd(&stats.fwd_pkts));
+    FMT("# TYPE cdnet_bytes_total counter\n");
+    FMT("cdnet_bytes_total{dir=\"tun2bus\"} %llu\n", (unsigned long long)rd(&stats.t2b_bytes));
+    FMT("cdnet_bytes_total{dir=\"bus2tun\"} %llu\n", (unsigned long long)rd(&stats.b2t_bytes));
+    FMT("cdnet_bytes_total{dir=\"bus2bus\"} %llu\n", (unsigned long long)rd(&stats.fwd_bytes));
+    FMT("# TYPE cdnet_frag_datagrams_total counter\n");
+    FMT("cdnet_frag_datagrams_total{dir=\"tun2bus\"} %llu\n", (unsigned long long)rd(&stats.frag_tx));
+    FMT("cdnet_frag_datagrams_total{dir=\"bus2tun\"} %llu\n", (unsigned long long)rd(&stats.frag_rx));
+    FMT("# TYPE cdnet_tun_paused_total counter\n");
+    FMT("cdnet_tun_paused_total %llu\n", (unsigned long long)rd(&stats.tun_paused));
+
+    FMT("# TYPE cdnet_queue_depth gauge\n");
+    for (int i = 0; i < gauge_num; i++)
+        FMT("cdnet_queue_depth{queue=\"%s\"} %u\n", gauges[i].name, gauges[i].get(gauges[i].arg));
+    if (len < size)
+        len += route_fmt(buf + len, size - len);
+    return min(len, size);
+}
+
+typedef struct {
+    ev_src_t    src;
+    char        cmd[64];
+    int         cmd_len;
+    char        *out;       // the reply, sent as the socket takes it
+    size_t      out_len;
+    size_t      out_pos;
+} stats_conn_t;
+
+static void stats_conn_close(stats_conn_t *c)
+{
+    ev_del(c->src.priv, &c->src);
+    close(c->src.fd);
+    free(c->out);
+    free(c);
+}
+
+// build the whole reply in memory, so a slow client never blocks the loop
+static int stats_conn_reply(stats_conn_t *c)
+{
+    const char *cmd = c->cmd;
+
+    if (strncmp(cmd, "trace", 5) == 0) {
+        FILE *fp = open_memstream(&c->out, &c->out_len);
+        if (!fp)
+            return -1;
+        trace_dump(fp);
+        if (fclose(fp))
+            return -1;
+    } else if (strncmp(cmd, "route", 5) == 0) {
+        if (!(c->out = malloc(STATS_REPLY_SIZE)))
+            return -1;
+        c->out_len = route_cmd(cmd, c->out, STATS_REPLY_SIZE);
+    } else if (!c->cmd_len || strncmp(cmd, "stats", 5) == 0) {
+        if (!(c->out = malloc(STATS_REPLY_SIZE)))
+            return -1;
+        c->out_len = stats_fmt(c->out, STATS_REPLY_SIZE);
+    } else {
+        c->out = strdup("unknown command, try: stats, trace, route\n");
+        if (!c->out)
+            return -1;
+        c->out_len = strlen(c->out);
+    }
+    return 0;
+}
+
+// one command per connection, read up to the '\n' or the end of input,
+// the reply is sent on EPOLLOUT, the socket stays non-blocking
+static void stats_conn_cb(ev_src_t *src, uint32_t events)
+{
+    stats_conn_t *c = container_of(src, stats_conn_t, src);
+
+    if (!c->out) {
+        int n = read(src->fd, c->cmd + c->cmd_len, sizeof(c->cmd) - 1 - c->cmd_len);
+        if (n < 0) {
+            if (errno != EAGAIN)
+                stats_conn_close(c);
+            return;
+        }
+        c->cmd_len += n;
+        c->cmd[c->cmd_len] = '\0';
+        char *end = memchr(c->cmd, '\n', c->cmd_len);
+        if (!end && n && c->cmd_len < (int)sizeof(c->cmd) - 1)
+            return; // wait for the rest of the command
+        if (end) {
+            *end = '\0';
+            c->cmd_len = end - c->cmd;
+        }
+        if (stats_conn_reply(c) || ev_mod(src->priv, src, EPOLLOUT)) {
+            stats_conn_close(c);
+            return;
+        }
+    }
+
+    while (c->out_pos < c->out_len) {
+        ssize_t n = send(src->fd, c->out + c->out_pos, c->out_len - c->out_pos, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN)
+                break; // the client is gone
+            return;
+        }
+        c->out_pos += n;
+    }
+    stats_conn_close(c);
+}
+
+static void stats_sock_cb(ev_src_t *src, uint32_t events)
+{
+    int fd = accept4(src->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+        return;
+    stats_conn_t *c = calloc(1, sizeof(stats_conn_t));
+    if (!c) {
+        close(fd);
+        return;
+    }
+    c->src.fd = fd;
+    c->src.cb = stats_conn_cb;
+    c->src.priv = src->priv;
+    if (ev_add(src->priv, &c->src, EPOLLIN)) {
+        close(fd);
+        free(c);
+    }
+}
+
+// the caller sets src->priv to the ev_loop of the thread owning the device
+// and adds src to it
+int stats_sock_init(ev_src_t *src, const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        d_error("stats: path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0) {
+        d_error("stats: listen on %s failed: %s\n", path, strerror(errno));
+        return -1;
+    }
+    src->fd = fd;
+    src->cb = stats_sock_cb;
+    d_info("stats: listen on %s\n", path);
+    return 0;
+}
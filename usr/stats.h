@@ -0,0 +1,93 @@
+/*
+ * Software License Agreement (BSD License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <d@d-l.io>
+ */
+
+/*
+ * stats: drop and traffic counters, queue depth gauges
+ *
+ * Each counter has a single writer thread, so it is bumped by a relaxed
+ * load and store, no locked instruction, and read tear-free by the thread
+ * serving the stats socket. The counters of each direction are on their
+ * own cache line.
+ *
+ * The stats socket (--stats-sock) is a unix stream socket, a client sends
+ * one command ended by '\n' or by shutting down the write side, and gets
+ * the answer until the socket is closed. The socket stays non-blocking,
+ * the answer is built in memory and sent as the client reads it, so a slow
+ * client never stalls the packet loop serving it:
+ *   "stats" or nothing (shut down the write side): a snapshot in the
+ *           prometheus text format
+ *   "trace": the trace rings in csv, see trace.h
+ *   "route ...": list or update the routing table, see route.h
+ * e.g.: socat - UNIX-CONNECT:/run/cdnet_tun.stats < /dev/null
+ */
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdatomic.h>
+#include "ev_loop.h"
+
+#define STATS_GAUGE_MAX     96  // 1 + 5 per bus, 5 more per bus with --threads
+#define STATS_REPLY_SIZE    32768 // the stats and route replies, the trace one grows as needed
+
+typedef enum {
+    // tun -> bus
+    DROP_IP_SHORT = 0,
+    DROP_IP_VERSION,
+    DROP_IP_UNSPEC,     // unspecified src address
+    DROP_IP_MCAST,
+    DROP_NOT_MATCH,     // dst not in our /104
+    DROP_NO_ROUTE,      // dst address type not mapped to cdnet
+    DROP_NO_ROUTER,     // no route to the net, see route.h
+    DROP_NOT_UDP,
+    DROP_PORT_OFFSET,
+    DROP_UDP_LEN,
+    DROP_TOO_BIG,       // exceed the frame size
+    DROP_GSO_TYPE,
+    DROP_TO_FRAME,
+    DROP_TX_QUEUE,      // tx_sched class full
+    // bus -> tun
+    DROP_FROM_FRAME,
+    DROP_TUN_WRITE,
+    DROP_FRAG,          // a datagram not put together: fragment lost, timeout or no slot
+    DROP_NUM
+} drop_reason_t;
+
+typedef struct {
+    _Alignas(64)
+    _Atomic uint64_t drop[DROP_NUM];
+    _Alignas(64)
+    _Atomic uint64_t t2b_pkts;  // tun -> bus, frames
+    _Atomic uint64_t t2b_bytes; // ip bytes
+    _Atomic uint64_t frag_tx;   // datagrams split into fragments
+    _Atomic uint64_t tun_paused; // tun read paused for a free frame, backpressure, not a drop
+    _Alignas(64)
+    _Atomic uint64_t b2t_pkts;
+    _Atomic uint64_t b2t_bytes;
+    _Atomic uint64_t frag_rx;   // datagrams put together
+    _Atomic uint64_t fwd_pkts;  // bus -> bus, frames
+    _Atomic uint64_t fwd_bytes; // frame bytes
+} stats_t;
+
+extern stats_t stats;
+
+#define STAT_ADD(c, n) \
+    atomic_store_explicit(&(c), atomic_load_explicit(&(c), memory_order_relaxed) + (n), memory_order_relaxed)
+
+static inline void stats_drop(drop_reason_t r)
+{
+    STAT_ADD(stats.drop[r], 1);
+}
+
+const char *stats_drop_name(drop_reason_t r);
+void stats_gauge_add(const char *name, uint32_t (* get)(void *arg), void *arg);
+int stats_fmt(char *buf, int size);
+int stats_sock_init(ev_src_t *src, const char *path);
+
+#endif
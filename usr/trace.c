@@ -0,0 +1,103 @@
+/*
+ * Software License Agreement (BSD License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <d@d-l.io>
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdatomic.h>
+#include "main.h"
+
+typedef struct {
+    uint64_t    t;      // ns
+    uint32_t    frame;
+    uint16_t    stage;
+    uint16_t    len;
+} trace_ent_t;
+
+typedef struct {
+    char        name[16];
+    atomic_uint wr;     // free running, written by the owner thread only
+    trace_ent_t ent[TRACE_RING_SIZE];
+} trace_ring_t;
+
+bool trace_on = false;
+
+static const char *stage_name[TR_STAGE_NUM] = {
+    "tun_read", "conv", "enq", "dev_put", "dev_out", "dev_rx", "tun_write", "fwd"
+};
+
+static __thread trace_ring_t *my_ring = NULL;
+static trace_ring_t *rings[TRACE_THREAD_MAX];
+static atomic_int ring_num = 0;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static trace_ring_t *ring_new(void)
+{
+    trace_ring_t *r = NULL;
+    pthread_mutex_lock(&ring_lock);
+    int n = atomic_load(&ring_num);
+    if (n < TRACE_THREAD_MAX && (r = calloc(1, sizeof(trace_ring_t)))) {
+        pthread_getname_np(pthread_self(), r->name, sizeof(r->name));
+        rings[n] = r;
+        atomic_store(&ring_num, n + 1);
+    }
+    pthread_mutex_unlock(&ring_lock);
+    if (!r)
+        trace_on = false;
+    return r;
+}
+
+void trace_rec(trace_stage_t stage, const cd_frame_t *frm, int len)
+{
+    trace_ring_t *r = my_ring;
+    if (!r && !(r = my_ring = ring_new()))
+        return;
+
+    unsigned wr = atomic_load_explicit(&r->wr, memory_order_relaxed);
+    trace_ent_t *e = &r->ent[wr & (TRACE_RING_SIZE - 1)];
+    e->t = lat_now();
+    e->frame = frm - frame_pool.frames;
+    e->stage = stage;
+    e->len = min(len, 0xffff); // a gso super packet may be larger
+    atomic_store_explicit(&r->wr, wr + 1, memory_order_release);
+}
+
+void trace_dump_file(const char *path)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        d_error("trace: open %s failed: %s\n", path, strerror(errno));
+        return;
+    }
+    trace_dump(fp);
+    fclose(fp);
+    d_info("trace: dumped to %s\n", path);
+}
+
+// racy against the writers: the oldest entries may be overwritten while
+// dumping, which only loses them, the timestamps are checked for order
+void trace_dump(FILE *fp)
+{
+    fprintf(fp, "thread,t_ns,stage,frame,len\n");
+    for (int i = 0; i < atomic_load(&ring_num); i++) {
+        trace_ring_t *r = rings[i];
+        unsigned wr = atomic_load_explicit(&r->wr, memory_order_acquire);
+        unsigned rd = wr > TRACE_RING_SIZE ? wr - TRACE_RING_SIZE : 0;
+        uint64_t last = 0;
+        for (; rd != wr; rd++) {
+            trace_ent_t e = r->ent[rd & (TRACE_RING_SIZE - 1)];
+            if (e.t < last || e.stage >= TR_STAGE_NUM)
+                continue;
+            last = e.t;
+            fprintf(fp, "%s,%llu,%s,%u,%u\n", r->name, (unsigned long long)e.t,
+                    stage_name[e.stage], e.frame, e.len);
+        }
+    }
+    fflush(fp);
+}
@@ -0,0 +1,62 @@
+/*
+ * Software License Agreement (BSD License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <d@d-l.io>
+ */
+
+/*
+ * trace: per-packet timestamp probes (--trace)
+ *
+ * Each thread records into its own ring of the last TRACE_RING_SIZE probes,
+ * allocated at its first probe. A probe is keyed by the frame index in
+ * frame_pool, the stages of one packet are the probes of its frame in time
+ * order, from TR_TUN_READ or TR_DEV_RX until the frame is reused. A frame
+ * forwarded between buses goes dev_rx, fwd, enq, dev_put, dev_out.
+ *
+ * Dump: SIGUSR1 writes --trace-file, the stats socket command "trace"
+ * streams the same csv: thread,t_ns,stage,frame,len
+ * len is the frame length (dat[2]), the ip length for tun_read, where the
+ * frame header is not written yet.
+ *
+ * With --trace off, a probe is a single not-taken branch.
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdio.h>
+#include <stdbool.h>
+#include "cdbus.h"
+
+#define TRACE_RING_SIZE     4096 // power of 2
+#define TRACE_THREAD_MAX    8
+
+typedef enum {
+    TR_TUN_READ = 0,    // ip packet read from the tun
+    TR_CONV,            // converted into a frame
+    TR_ENQ,             // queued in tx_sched
+    TR_DEV_PUT,         // handed to the device backend
+    TR_DEV_OUT,         // handed to the driver / chip
+    TR_DEV_RX,          // received from the device backend
+    TR_TUN_WRITE,       // ip packet written to the tun
+    TR_FWD,             // received frame forwarded to another bus
+    TR_STAGE_NUM
+} trace_stage_t;
+
+extern bool trace_on;
+
+void trace_rec(trace_stage_t stage, const cd_frame_t *frm, int len);
+void trace_dump(FILE *fp);
+void trace_dump_file(const char *path);
+
+#define TRACE_LEN(stage, frm, len) do { \
+        if (__builtin_expect(trace_on, 0)) \
+            trace_rec(stage, frm, len); \
+    } while (0)
+
+#define TRACE(stage, frm) TRACE_LEN(stage, frm, (frm)->dat[2])
+
+#endif
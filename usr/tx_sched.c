@@ -0,0 +1,187 @@
+/*
+ * Software License Agreement (BSD License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <d@d-l.io>
+ */
+
+#include <time.h>
+#include "main.h"
+
+tx_port_rule_t tx_port_rules[TX_PORT_RULE_MAX];
+int tx_port_rule_num = 0;
+
+
+static uint32_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000U + ts.tv_nsec / 1000;
+}
+
+int tx_sched_init(tx_sched_t *s, list_head_t *free_head, const uint32_t *depth, const bool *drop_head)
+{
+    memset(s, 0, sizeof(*s));
+    s->free_head = free_head;
+
+    for (int i = 0; i < TX_CLASS_NUM; i++) {
+        tx_class_t *c = &s->cls[i];
+        list_head_init(&c->head);
+        c->depth = max(depth[i], 1);
+        c->drop_head = drop_head[i];
+        c->t_enq = calloc(c->depth, sizeof(uint32_t));
+        if (!c->t_enq)
+            return -1;
+        d_info("tx_sched: class %d, depth: %d, drop: %s\n", i, c->depth, c->drop_head ? "head" : "tail");
+    }
+    return 0;
+}
+
+static void class_drop_head(tx_sched_t *s, tx_class_t *c)
+{
+    cd_frame_t *old = list_get_entry(&c->head, cd_frame_t);
+    c->t_rd = (c->t_rd + 1) % c->depth;
+    c->drop_cnt++;
+    stats_drop(DROP_TX_QUEUE);
+    list_put(s->free_head, &old->node);
+}
+
+// return -1 if the frame is dropped, which is returned to free_head
+int tx_sched_put(tx_sched_t *s, cd_frame_t *frm, int cls)
+{
+    tx_class_t *c = &s->cls[cls];
+
+    if (c->head.len >= c->depth) {
+        if (!c->drop_head) {
+            c->drop_cnt++;
+            stats_drop(DROP_TX_QUEUE);
+            list_put(s->free_head, &frm->node);
+            d_verbose("tx_sched: class %d full, drop new\n", cls);
+            return -1;
+        }
+        class_drop_head(s, c);
+        d_verbose("tx_sched: class %d full, drop old\n", cls);
+    }
+
+    c->t_enq[c->t_wr] = now_us();
+    c->t_wr = (c->t_wr + 1) % c->depth;
+    c->enq_cnt++;
+    TRACE(TR_ENQ, frm);
+    list_put(&c->head, &frm->node);
+    return 0;
+}
+
+cd_frame_t *tx_sched_get(tx_sched_t *s)
+{
+    for (int i = 0; i < TX_CLASS_NUM; i++) {
+        tx_class_t *c = &s->cls[i];
+        cd_frame_t *frm = list_get_entry(&c->head, cd_frame_t);
+        if (!frm)
+            continue;
+
+        uint32_t wait = now_us() - c->t_enq[c->t_rd];
+        c->t_rd = (c->t_rd + 1) % c->depth;
+        int b = 0;
+        while (wait >> b && b < TX_HIST_SIZE - 1)
+            b++;
+        c->hist[b]++;
+        c->deq_cnt++;
+        return frm;
+    }
+    return NULL;
+}
+
+uint32_t tx_sched_len(tx_sched_t *s)
+{
+    uint32_t len = 0;
+    for (int i = 0; i < TX_CLASS_NUM; i++)
+        len += s->cls[i].head.len;
+    return len;
+}
+
+// the frames handed over are held by the device from now on, it returns them
+// to free_head and may take them again for rx without telling frame_pool
+void tx_sched_feed(tx_sched_t *s, cd_dev_t *dev, list_head_t *dev_head, uint32_t dev_depth)
+{
+    while (dev_head->len < dev_depth) {
+        cd_frame_t *frm = tx_sched_get(s);
+        if (!frm)
+            break;
+        TRACE(TR_DEV_PUT, frm);
+        frame_pool_lease(&frame_pool, frm, POOL_DEV);
+        dev->put_tx_frame(dev, frm);
+    }
+}
+
+// upper bound of the queueing time in us of the pct percentile,
+// bucket b holds the time in [2^(b-1), 2^b) us
+uint32_t tx_sched_percentile(tx_sched_t *s, int cls, int pct)
+{
+    tx_class_t *c = &s->cls[cls];
+    uint64_t total = 0, sum = 0;
+
+    for (int b = 0; b < TX_HIST_SIZE; b++)
+        total += c->hist[b];
+    if (!total)
+        return 0;
+    for (int b = 0; b < TX_HIST_SIZE; b++) {
+        sum += c->hist[b];
+        if (sum * 100 >= total * pct)
+            return 1U << b;
+    }
+    return 1U << (TX_HIST_SIZE - 1);
+}
+
+void tx_sched_dump(tx_sched_t *s)
+{
+    for (int i = 0; i < TX_CLASS_NUM; i++) {
+        tx_class_t *c = &s->cls[i];
+        d_info("tx_sched: class %d: len %d, enq %u, deq %u, drop %u, p50 < %u us, p99 < %u us\n",
+                i, c->head.len, c->enq_cnt, c->deq_cnt, c->drop_cnt,
+                tx_sched_percentile(s, i, 50), tx_sched_percentile(s, i, 99));
+    }
+}
+
+
+int tx_classify(uint8_t tclass, uint16_t dst_port)
+{
+    uint8_t dscp = tclass >> 2;
+
+    if (dscp >= 40) // CS5, EF(46), CS6, CS7
+        return 0;
+    if (dscp == 8 || dscp == 1) // CS1, LE
+        return 2;
+    if (dscp == 0) {
+        for (int i = 0; i < tx_port_rule_num; i++) {
+            if (dst_port >= tx_port_rules[i].lo && dst_port <= tx_port_rules[i].hi)
+                return tx_port_rules[i].cls;
+        }
+    }
+    return TX_CLASS_DEF;
+}
+
+// format: lo[-hi]:cls[,lo[-hi]:cls...], e.g. "1-9:0,5000-5999:2"
+int tx_port_rules_parse(const char *str)
+{
+    while (str && *str) {
+        unsigned lo, hi, cls;
+        int n;
+        if (sscanf(str, "%u-%u:%u%n", &lo, &hi, &cls, &n) != 3) {
+            if (sscanf(str, "%u:%u%n", &lo, &cls, &n) != 2)
+                return -1;
+            hi = lo;
+        }
+        if (tx_port_rule_num >= TX_PORT_RULE_MAX || cls >= TX_CLASS_NUM || lo > hi || hi > 0xffff)
+            return -1;
+        tx_port_rules[tx_port_rule_num++] = (tx_port_rule_t){ .lo = lo, .hi = hi, .cls = cls };
+        d_info("tx_sched: port %u-%u -> class %u\n", lo, hi, cls);
+        str += n;
+        if (*str == ',')
+            str++;
+        else if (*str)
+            return -1;
+    }
+    return 0;
+}
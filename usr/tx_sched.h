@@ -0,0 +1,73 @@
+/*
+ * Software License Agreement (BSD License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <d@d-l.io>
+ */
+
+/*
+ * tx_sched: strict priority tx queues in front of the device
+ *
+ * Frames from the tun are put into one of TX_CLASS_NUM queues, class 0 first.
+ * tx_sched_feed moves them into the device tx queue while it holds less than
+ * dev_depth frames, so a high priority frame only waits behind dev_depth
+ * frames already handed to the device.
+ *
+ * Classification: DSCP of the ipv6 traffic class first, then the dst port
+ * rules for packets without DSCP, then TX_CLASS_DEF.
+ */
+
+#ifndef __TX_SCHED_H__
+#define __TX_SCHED_H__
+
+#include "cdbus.h"
+
+#define TX_CLASS_NUM        3   // 0: high, 1: normal, 2: bulk
+#define TX_CLASS_DEF        1
+#define TX_PORT_RULE_MAX    16
+#define TX_HIST_SIZE        32  // log2 buckets of queueing time in us
+
+typedef struct {
+    uint16_t    lo;
+    uint16_t    hi;
+    uint8_t     cls;
+} tx_port_rule_t;
+
+typedef struct {
+    list_head_t head;
+    uint32_t    depth;      // max frames queued
+    bool        drop_head;  // if full: true: drop the oldest, false: drop the new one
+
+    uint32_t    *t_enq;     // enqueue time of each queued frame, fifo in step with head
+    uint32_t    t_rd;
+    uint32_t    t_wr;
+
+    uint32_t    enq_cnt;
+    uint32_t    deq_cnt;
+    uint32_t    drop_cnt;
+    uint32_t    hist[TX_HIST_SIZE];
+} tx_class_t;
+
+typedef struct {
+    tx_class_t  cls[TX_CLASS_NUM];
+    list_head_t *free_head;
+} tx_sched_t;
+
+
+extern tx_port_rule_t tx_port_rules[TX_PORT_RULE_MAX];
+extern int tx_port_rule_num;
+
+int tx_sched_init(tx_sched_t *s, list_head_t *free_head, const uint32_t *depth, const bool *drop_head);
+int tx_sched_put(tx_sched_t *s, cd_frame_t *frm, int cls);
+cd_frame_t *tx_sched_get(tx_sched_t *s);
+uint32_t tx_sched_len(tx_sched_t *s);
+void tx_sched_feed(tx_sched_t *s, cd_dev_t *dev, list_head_t *dev_head, uint32_t dev_depth);
+uint32_t tx_sched_percentile(tx_sched_t *s, int cls, int pct);
+void tx_sched_dump(tx_sched_t *s);
+
+int tx_classify(uint8_t tclass, uint16_t dst_port);
+int tx_port_rules_parse(const char *str);
+
+#endif